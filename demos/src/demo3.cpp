@@ -31,6 +31,7 @@ int main(int argc, const char* argv[])
 	light.power = { 1.5, 1.5, 1.5 };
 	light.ambience = 0.01;
 	mat4x4_perspective(light.projection.v, M_PI / 2, 1, 0.1, 100);
+	renderer.light = &light;
 
 	// define render passes
 	auto shadow_pass = seen::ShadowPass(512, true);
@@ -41,8 +42,6 @@ int main(int argc, const char* argv[])
 	});
 
 	seen::CustomPass land_pass([&](int index) {
-		light.position = { 2 * cos(t), 2, 2 * sin(t) };
-
 		seen::ShaderProgram& shader = seen::ShaderProgram::builtin_realistic().use();
 
 		shader << dirt_mat;
@@ -65,6 +64,7 @@ int main(int argc, const char* argv[])
 	while (renderer.is_running())
 	{
 		t += 0.01;
+		light.position = { 2 * cos(t), 2, 2 * sin(t) };
 
 		renderer.draw(&cam, {
 			&shadow_pass,
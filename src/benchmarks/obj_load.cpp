@@ -0,0 +1,104 @@
+#include "seen.hpp"
+
+#include <chrono>
+
+using namespace seen;
+
+//------------------------------------------------------------------------------
+// an n by n grid, every record type OBJMesh reads
+static std::string grid_obj(int n)
+{
+	std::string obj;
+	char line[128];
+
+	for (int y = 0; y < n; y++)
+	for (int x = 0; x < n; x++)
+	{
+		snprintf(line, sizeof(line), "v %f %f %f\n", x * 0.137f, sinf(x * 0.01f + y * 0.02f), y * 0.137f);
+		obj += line;
+		snprintf(line, sizeof(line), "vt %f %f\n", x / (float)n, y / (float)n);
+		obj += line;
+		obj += "vn 0.000000 1.000000 0.000000\n";
+	}
+
+	for (int y = 0; y < n - 1; y++)
+	for (int x = 0; x < n - 1; x++)
+	{
+		int a = y * n + x + 1, b = a + 1, c = a + n, d = c + 1;
+		snprintf(line, sizeof(line), "f %d/%d/%d %d/%d/%d %d/%d/%d\n", a, a, a, c, c, c, b, b, b);
+		obj += line;
+		snprintf(line, sizeof(line), "f %d/%d/%d %d/%d/%d %d/%d/%d\n", b, b, b, c, c, c, d, d, d);
+		obj += line;
+	}
+
+	return obj;
+}
+//------------------------------------------------------------------------------
+
+// how OBJMesh used to read, a read() per byte then strtok_r and sscanf.
+// Only tokenizes, no vertices are built.
+static float reference_parse(int fd)
+{
+	char line[256];
+	float sum = 0;
+
+	for (;;)
+	{
+		int size = 0;
+		while (read(fd, line + size, 1) && line[size] != '\n') { ++size; }
+		line[size] = '\0';
+
+		if (size == 0) break;
+
+		char* save_ptr = nullptr;
+		char* token = strtok_r(line, " ", &save_ptr);
+
+		while ((token = strtok_r(nullptr, " ", &save_ptr)))
+		{
+			for (char* c = token; *c; c++) { if (*c == '/') *c = ' '; }
+
+			float v[3] = {};
+			sscanf(token, "%f %f %f", v, v + 1, v + 2);
+			sum += v[0] + v[1] + v[2];
+		}
+	}
+
+	return sum;
+}
+//------------------------------------------------------------------------------
+
+static double since(std::chrono::steady_clock::time_point start)
+{
+	return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+}
+//------------------------------------------------------------------------------
+
+int main(int argc, char* argv[])
+{
+	std::string obj = grid_obj(argc > 1 ? atoi(argv[1]) : 200);
+	double mb = obj.size() / 1e6;
+
+	char path[] = "/tmp/seen_obj_XXXXXX";
+	int fd = mkstemp(path);
+	assert(fd >= 0);
+	assert(write(fd, obj.data(), obj.size()) == (ssize_t)obj.size());
+
+	lseek(fd, 0, SEEK_SET);
+	auto start = std::chrono::steady_clock::now();
+	float sum = reference_parse(fd);
+	double reference = since(start);
+
+	lseek(fd, 0, SEEK_SET);
+	start = std::chrono::steady_clock::now();
+	OBJMesh mesh(fd);
+	double mapped = since(start);
+
+	close(fd);
+	unlink(path);
+
+	printf("%.1f MB, %u vertices, %u indices (%g)\n", mb, mesh.vert_count(), mesh.index_count(), sum);
+	printf("read() per byte + strtok_r/sscanf, tokenizing only: %6.1f MB/s\n", mb / reference);
+	printf("OBJMesh, mmap + in place tokenizer, whole load:     %6.1f MB/s (%.1fx)\n", mb / mapped, reference / mapped);
+
+	return 0;
+}
@@ -0,0 +1,46 @@
+#include "seen.hpp"
+
+#include <chrono>
+
+using namespace seen;
+
+//------------------------------------------------------------------------------
+static double ns_per(int iterations, std::chrono::steady_clock::time_point start)
+{
+	std::chrono::duration<double, std::nano> elapsed = std::chrono::steady_clock::now() - start;
+	return elapsed.count() / iterations;
+}
+//------------------------------------------------------------------------------
+
+int main(int argc, char* argv[])
+{
+	const int draws = 1000000;
+
+	RendererGL renderer("./data", "uniform_lookup", 64, 64, 3, 3);
+	ShaderProgram& shader = ShaderProgram::builtin_shadow_depth().use();
+
+	// the values never change, so after the first draw no glUniform call
+	// is made and what's left is finding the parameter
+	Positionable p;
+	shader << &p;
+
+	auto start = std::chrono::steady_clock::now();
+	for (int i = draws; i--;)
+	{
+		shader["u_world_matrix"] << p.world();
+		shader["u_normal_matrix"] << p.normal_matrix;
+	}
+	double by_name = ns_per(draws, start);
+
+	start = std::chrono::steady_clock::now();
+	for (int i = draws; i--;)
+	{
+		shader << &p;
+	}
+	double by_handle = ns_per(draws, start);
+
+	printf("world and normal matrix by name:   %5.1f ns/draw\n", by_name);
+	printf("world and normal matrix by handle: %5.1f ns/draw (%.1fx)\n", by_handle, by_name / by_handle);
+
+	return 0;
+}
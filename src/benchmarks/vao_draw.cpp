@@ -0,0 +1,72 @@
+#include "seen.hpp"
+
+#include <chrono>
+
+using namespace seen;
+
+//------------------------------------------------------------------------------
+static double draws_per_second(std::vector<Model*>& scene, int frames)
+{
+	glFinish();
+	auto start = std::chrono::steady_clock::now();
+
+	for (int i = frames; i--;)
+	{
+		glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+
+		for (auto model : scene)
+		{
+			model->draw();
+		}
+
+		glFinish();
+	}
+
+	std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+
+	return scene.size() * frames / elapsed.count();
+}
+//------------------------------------------------------------------------------
+
+static std::vector<Model*> grid_scene(Mesh* mesh, int side, bool vertex_array)
+{
+	std::vector<Model*> scene;
+
+	for (int i = 0; i < side * side; i++)
+	{
+		Model* model = new Model(mesh, VertexFormat::FLOAT, vertex_array);
+		model->position((i % side) * 2.f, 0, (i / side) * 2.f);
+		scene.push_back(model);
+	}
+
+	return scene;
+}
+//------------------------------------------------------------------------------
+
+int main(int argc, char* argv[])
+{
+	const int side = 100, frames = 20;
+
+	RendererGL renderer("./data", "vao_draw", 64, 64, 3, 3);
+	ShaderProgram::builtin_shadow_depth().use();
+
+	// every model gets its own buffers, so each draw switches them
+	Plane plane(1, 2);
+	std::vector<Model*> with_vao = grid_scene(&plane, side, true);
+	std::vector<Model*> without_vao = grid_scene(&plane, side, false);
+
+	draws_per_second(without_vao, 2); // warm up
+	double respecified = draws_per_second(without_vao, frames);
+
+	draws_per_second(with_vao, 2);
+	double bound = draws_per_second(with_vao, frames);
+
+	printf("%zu models, %d frames\n", with_vao.size(), frames);
+	printf("attributes specified per draw: %8.0f draws/s\n", respecified);
+	printf("vertex array bound per draw:   %8.0f draws/s (%.2fx)\n", bound, bound / respecified);
+
+	for (auto model : with_vao) delete model;
+	for (auto model : without_vao) delete model;
+
+	return 0;
+}
@@ -0,0 +1,77 @@
+#include "seen.hpp"
+
+#include <chrono>
+
+using namespace seen;
+
+//------------------------------------------------------------------------------
+static double since(std::chrono::steady_clock::time_point start)
+{
+	return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+}
+//------------------------------------------------------------------------------
+
+int main(int argc, char* argv[])
+{
+	const uint32_t n = argc > 1 ? atoi(argv[1]) : 700;
+
+	// pos/tex/norm corners of an n by n grid's faces, as an OBJ lists
+	// them. Most positions are shared by six corners.
+	std::vector<uint32_t> corners;
+	for (uint32_t y = 0; y < n - 1; y++)
+	for (uint32_t x = 0; x < n - 1; x++)
+	{
+		uint32_t a = y * n + x + 1, b = a + 1, c = a + n, d = c + 1;
+		for (uint32_t i : { a, c, b, b, c, d })
+		{
+			corners.insert(corners.end(), { i, i, 1 });
+		}
+	}
+	size_t count = corners.size() / 3;
+
+	// how OBJMesh used to key its corners
+	auto start = std::chrono::steady_clock::now();
+	std::map<std::string, uint32_t> map;
+	std::vector<uint32_t> map_indices;
+	for (size_t i = 0; i < count; i++)
+	{
+		const uint32_t* key = &corners[i * 3];
+		char token[36];
+		snprintf(token, sizeof(token), "%u/%u/%u", key[0], key[1], key[2]);
+
+		std::string vert_token(token);
+		if (map.count(vert_token) == 0)
+		{
+			uint32_t next = map.size();
+			map[vert_token] = next;
+		}
+
+		map_indices.push_back(map[vert_token]);
+	}
+	double mapped = since(start);
+
+	start = std::chrono::steady_clock::now();
+	VertexTable table(n * n);
+	std::vector<uint32_t> table_indices;
+	uint32_t unique = 0;
+	for (size_t i = 0; i < count; i++)
+	{
+		uint32_t index = table.find_or_insert(&corners[i * 3], unique);
+		if (index == unique) unique++;
+
+		table_indices.push_back(index);
+	}
+	double tabled = since(start);
+
+	if (table_indices != map_indices)
+	{
+		fprintf(stderr, "VertexTable and std::map disagree\n");
+		return 1;
+	}
+
+	printf("%zu corners, %u unique\n", count, unique);
+	printf("std::map<std::string>: %6.1f M corners/s\n", count / mapped / 1e6);
+	printf("VertexTable:           %6.1f M corners/s (%.1fx)\n", count / tabled / 1e6, mapped / tabled);
+
+	return 0;
+}
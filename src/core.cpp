@@ -59,6 +59,9 @@ fail:
 
 using namespace seen;
 
+Viewer* Viewer::active;
+
+
 Vec3& Positionable::position()
 {
 	return _position;
@@ -4,6 +4,8 @@
 #include <unistd.h>
 #include <assert.h>
 #include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 
 // c libs
 #include "string.h"
@@ -20,6 +22,12 @@
 #include <algorithm>
 #include <functional>
 #include <initializer_list>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <future>
+#include <deque>
+#include <atomic>
 
 // project libs
 #ifdef __linux__
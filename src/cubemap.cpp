@@ -146,8 +146,11 @@ void Cubemap::draw_at(Vec3 position,
 
 	assert(gl_get_error());
 
+	static const Uniform u_proj_matrix("u_proj_matrix");
+	static const Uniform u_view_matrix("u_view_matrix");
+
 	auto shader = *ShaderProgram::active();
-	shader["u_proj_matrix"] << side_projection;
+	shader[u_proj_matrix] << side_projection;
 
 	int i = 0;
 	for(; i < 6; i++)
@@ -155,7 +158,8 @@ void Cubemap::draw_at(Vec3 position,
 		render_to(sides[i]);
 		glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
 
-		shader["u_view_matrix"] << cube_views[i];
+		shader[u_view_matrix] << cube_views[i];
+		Shaders.update_frame_block(cube_views[i].v, side_projection.v, position.v);
 
 		assert(gl_get_error());
 
@@ -170,6 +174,13 @@ void Cubemap::draw_at(Vec3 position,
 
 		assert(gl_get_error());
 	}
+
+	// put the frame's camera back for whatever draws next
+	if (Viewer::active)
+	{
+		Shaders.update_blocks(Viewer::active, nullptr);
+	}
+
 	assert(gl_get_error());
 }
 
@@ -54,10 +54,15 @@ void CustomPass::draw(Viewer* viewer)
 
 		if(viewer && i == 0)
 		{
+			static const Uniform u_view_matrix("u_view_matrix");
+			static const Uniform u_proj_matrix("u_proj_matrix");
+
 			ShaderProgram& shader = *ShaderProgram::active();
-			shader["u_view_matrix"] << viewer->_view;
-			shader["u_proj_matrix"] << viewer->_projection;
+			shader[u_view_matrix] << viewer->_view;
+			shader[u_proj_matrix] << viewer->_projection;
 
+			// programs built with uniform blocks read these from there
+			Shaders.update_blocks(viewer, nullptr);
 		}
 
 		for(auto drawable : scene->all())
@@ -65,6 +70,11 @@ void CustomPass::draw(Viewer* viewer)
 			drawable->draw();
 		}
 	}
+
+	if (viewer && viewer != Viewer::active && Viewer::active)
+	{
+		Shaders.update_blocks(Viewer::active, nullptr);
+	}
 }
 
 
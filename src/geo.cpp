@@ -1,8 +1,48 @@
 #include "geo.hpp"
 #include "shader.hpp"
+#include "renderergl.hpp"
+#include "loader.hpp"
+
+#ifdef __SSE2__
+#include <immintrin.h>
+#endif
 
 using namespace seen;
 
+//------------------------------------------------------------------------------
+Bounds Bounds::transformed(mat4x4 world)
+{
+	Bounds out;
+	vec4 c = { center.x, center.y, center.z, 1 }, moved;
+
+	mat4x4_mul_vec4(moved, world, c);
+	out.center = Vec3(moved[0], moved[1], moved[2]);
+
+	// the box's extent along each world axis, from the matrix's
+	// contributions of each local axis
+	for(int i = 0; i < 3; ++i)
+	{
+		out.min.v[i] = out.max.v[i] = world[3][i];
+
+		for(int j = 0; j < 3; ++j)
+		{
+			float a = world[j][i] * min.v[j], b = world[j][i] * max.v[j];
+			out.min.v[i] += std::min(a, b);
+			out.max.v[i] += std::max(a, b);
+		}
+	}
+
+	// grows by the largest scale among the axes
+	float scale = 0;
+	for(int j = 0; j < 3; ++j)
+	{
+		scale = std::max(scale, vec3_len(world[j]));
+	}
+	out.radius = radius * scale;
+
+	return out;
+}
+
 //------------------------------------------------------------------------------
 unsigned int Mesh::vert_count()
 {
@@ -22,676 +62,2907 @@ Vertex* Mesh::verts()
 }
 
 //------------------------------------------------------------------------------
-uint16_t* Mesh::inds()
+uint32_t* Mesh::inds()
 {
 	return indices.data();
 }
 
 //------------------------------------------------------------------------------
-void Mesh::compute_normals()
+GLenum Mesh::index_type()
 {
-	Vertex* v = verts();
+	// 16 bit indices halve index bandwidth, use them whenever they can
+	// address all of the vertices
+	return vert_count() <= 0x10000 ? GL_UNSIGNED_SHORT : GL_UNSIGNED_INT;
+}
 
-	for(unsigned int i = 0; i < indices.size(); i += 3)
+//------------------------------------------------------------------------------
+const void* Mesh::index_buffer(std::vector<uint16_t>& scratch)
+{
+	if(index_type() == GL_UNSIGNED_INT)
 	{
-		vec3 diff[2];
-
-		vec3_sub(diff[0], v[indices[i + 0]].position, v[indices[i + 1]].position);
-		vec3_sub(diff[1], v[indices[i + 0]].position, v[indices[i + 2]].position);
-
-		Vertex* vert = v + indices[i];
-		vec3 cross;
-		vec3_mul_cross(cross, diff[0], diff[1]);
-		vec3_norm(vert->normal, cross);
-
-		if(isnan(vert->normal[0]) || isnan(vert->normal[1]) || isnan(vert->normal[2]))
-		{
-			// assert(0);
-		}
-
-		i = (i + 1) - 1;
+		return indices.data();
 	}
+
+	scratch.assign(indices.begin(), indices.end());
+	return scratch.data();
 }
-//------------------------------------------------------------------------------
 
-void Mesh::compute_tangents()
+//------------------------------------------------------------------------------
+// runs work over [0, count) in contiguous ranges, one per thread
+static void parallel_ranges(size_t count, int threads, const std::function<void(size_t, size_t)>& work)
 {
-	Vertex* v = verts();
+	// not worth a thread for less than a few thousand items
+	threads = std::max(1, std::min(threads, (int)(count / 4096)));
 
-	for(unsigned int i = 0; i < indices.size(); i += 3)
+	if (threads == 1)
 	{
+		work(0, count);
+		return;
+	}
 
-		vec3_sub(v[indices[i + 0]].tangent, v[indices[i]].position, v[indices[i + 1]].position);
+	std::vector<std::thread> workers;
+	for (int i = 0; i < threads; i++)
+	{
+		workers.push_back(std::thread(work, count * i / threads, count * (i + 1) / threads));
+	}
 
-		for(int j = 3; j--;)
-		{
-			vec3_norm(v[indices[i + j]].tangent, v[indices[i + j]].tangent);
-		}
+	for (auto& worker : workers)
+	{
+		worker.join();
 	}
 }
-//------------------------------------------------------------------------------
-
-Vec3 Mesh::min_position()
-{
-	if(_min) return *_min;
-	Vertex* v = verts();
-	_min = new Vec3(v->position[0], v->position[1], v->position[2]);
 
-	for(int i = vert_count(); i--;)
+//------------------------------------------------------------------------------
+// every triangle corner that references each vertex, as triangle * 3 + corner
+struct VertexCorners {
+	VertexCorners(const std::vector<uint32_t>& indices, size_t vertex_count)
 	{
-		for(int j = 3; j--;)
+		offsets.assign(vertex_count + 1, 0);
+		for (auto i : indices) offsets[i + 1]++;
+		for (size_t i = 0; i < vertex_count; i++) offsets[i + 1] += offsets[i];
+
+		std::vector<uint32_t> fill(offsets.begin(), offsets.end() - 1);
+		corners.resize(indices.size());
+		for (size_t c = 0; c < indices.size(); c++)
 		{
-			if(v[i].position[j] < _min->v[j])
-			{
-				_min->v[j] = v[i].position[j];
-			}
+			corners[fill[indices[c]]++] = c;
 		}
 	}
 
-	return *_min;
-}
+	std::vector<uint32_t> offsets, corners;
+};
 
 //------------------------------------------------------------------------------
-Vec3 Mesh::max_position()
-{
-	if(_max) return *_max;
-	Vertex* v = verts();
-	_max = new Vec3(v->position[0], v->position[1], v->position[2]);
-
-	for(int i = vert_count(); i--;)
+// per triangle frames, structure of arrays
+struct FaceFrames {
+	FaceFrames(size_t triangles)
 	{
-		for(int j = 3; j--;)
+		for (int c = 3; c--;)
 		{
-			if(v[i].position[j] > _max->v[j])
-			{
-				_max->v[j] = v[i].position[j];
-			}
+			normal[c].resize(triangles);
+			tangent[c].resize(triangles);
 		}
+		handedness.resize(triangles);
+		angle.resize(triangles * 3);
 	}
 
-	return *_max;
-}
+	std::vector<float> normal[3];  // area weighted, unnormalized
+	std::vector<float> tangent[3]; // unit, along +u
+	std::vector<float> handedness; // -1 where the uv mapping is mirrored
+	std::vector<float> angle;      // at each corner
+};
+
+//------------------------------------------------------------------------------
+// the corners of a run of faces, copied out of the vertex array as
+// structure of arrays so the kernels below load four faces at once
+struct FaceBatch {
+	static const size_t size = 256;
+
+	float p[3][3][size];   // corner, axis, face
+	float uv[3][2][size];  // corner, axis, face
+	float cosine[3][size]; // corner, face
+};
 
+const size_t FaceBatch::size;
 
 //------------------------------------------------------------------------------
-Vec3 Mesh::box_dimensions()
+static void gather_faces(const Vertex* v, const uint32_t* tri, size_t count, FaceBatch& batch)
 {
-	Vec3 min = min_position();
-	Vec3 max = max_position();
-	return max - min;
-}
+	for (size_t f = 0; f < count; f++, tri += 3)
+	for (int k = 0; k < 3; k++)
+	{
+		const Vertex& corner = v[tri[k]];
 
+		batch.p[k][0][f] = corner.position[0];
+		batch.p[k][1][f] = corner.position[1];
+		batch.p[k][2][f] = corner.position[2];
+		batch.uv[k][0][f] = corner.texture[0];
+		batch.uv[k][1][f] = corner.texture[1];
+	}
+}
 
 //------------------------------------------------------------------------------
-//    ___ _____ _
-//   / __|_   _| |
-//   \__ \ | | | |__
-//   |___/ |_| |____|
-//
-STLMesh::STLMesh(int fd)
+// frame of the batch's face f, written to faces at t. Matches the SSE
+// kernel operation for operation, so results don't depend on the lane
+static void face_frame(FaceBatch& batch, size_t f, size_t t, FaceFrames& faces, bool angles)
 {
-	assert(fd > 0);
+	float e1[3], e2[3], tan[3];
 
-	// read the header
-	assert(read(fd, this->header, STL_HEADER_SIZE) == STL_HEADER_SIZE);
+	for (int i = 0; i < 3; i++)
+	{
+		e1[i] = batch.p[1][i][f] - batch.p[0][i][f];
+		e2[i] = batch.p[2][i][f] - batch.p[0][i][f];
+	}
 
-	// get the number of triangles
-	assert(read(fd, &this->tri_count, sizeof(this->tri_count)) == sizeof(this->tri_count));
+	faces.normal[0][t] = e1[1] * e2[2] - e1[2] * e2[1];
+	faces.normal[1][t] = e1[2] * e2[0] - e1[0] * e2[2];
+	faces.normal[2][t] = e1[0] * e2[1] - e1[1] * e2[0];
 
-	// allocate space for the model's geometry
-	unsigned int vert_count = this->tri_count * 3;
-	all_verts = new Vertex[vert_count];
-	all_positions = new Vec3[vert_count];
-	all_normals = new Vec3[this->tri_count];
-	this->tris = new STLTri[this->tri_count];
-	this->_indices = new unsigned int[vert_count];
+	float du1 = batch.uv[1][0][f] - batch.uv[0][0][f], dv1 = batch.uv[1][1][f] - batch.uv[0][1][f];
+	float du2 = batch.uv[2][0][f] - batch.uv[0][0][f], dv2 = batch.uv[2][1][f] - batch.uv[0][1][f];
+	float det = du1 * dv2 - du2 * dv1;
+	float len2 = 0;
 
-	// fill out a list of indicies, one for each vert
-	// doing this just to appease ode. Since stl files
-	// have no such concept
-	for(int i = vert_count; i--;)
+	for (int i = 0; i < 3; i++)
 	{
-		_indices[i] = i;
+		tan[i] = (e1[i] * dv2 - e2[i] * dv1) * (det < 0 ? -1 : 1);
+		len2 += tan[i] * tan[i];
 	}
 
-	assert(this->tris && all_positions && all_normals);
+	// n . (t x b) = |n|^2 / det, so the uv determinant's sign is the sign
+	// the bitangent needs against n x t
+	faces.handedness[t] = det < 0 ? -1 : 1;
 
-	// read all the geometry
-	for(unsigned int i = 0; i < this->tri_count; ++i)
+	// without a usable uv mapping fall back to the first edge
+	if (!(fabsf(det) > 1e-12f && len2 > 1e-24f))
 	{
-		STLTri* tri = this->tris + i;
-
-		// point the verts and normal at the appropriate
-		// spot allocated in the contiguious arrays
-		tri->verts = all_positions + (i * 3);
-		tri->normal = all_normals + i;
-
-		// read from file
-		read(fd, tri->normal, sizeof(Vec3));
-		read(fd, tri->verts, sizeof(Vec3) * 3);
-		read(fd, &tri->attr, sizeof(tri->attr));
+		faces.handedness[t] = 1;
+		len2 = 0;
+		for (int i = 0; i < 3; i++)
+		{
+			tan[i] = e1[i];
+			len2 += tan[i] * tan[i];
+		}
+	}
 
-		// Copy positions and normals into contiguious array
-		// for rendering
-		vec3_copy(all_verts[(i * 3) + 0].position , tri->verts[0].v);
-		vec3_copy(all_verts[(i * 3) + 0].normal   , tri->normal->v);
-		vec3_copy(all_verts[(i * 3) + 1].position , tri->verts[1].v);
-		vec3_copy(all_verts[(i * 3) + 1].normal   , tri->normal->v);
-		vec3_copy(all_verts[(i * 3) + 2].position , tri->verts[2].v);
-		vec3_copy(all_verts[(i * 3) + 2].normal   , tri->normal->v);
+	float inv = 1 / sqrtf(std::max(len2, 1e-30f));
+	for (int i = 0; i < 3; i++)
+	{
+		faces.tangent[i][t] = tan[i] * inv;
 	}
 
-	compute_tangents();
-}
-//------------------------------------------------------------------------------
-STLMesh::~STLMesh()
-{
-	delete this->tris[0].verts;
-	delete this->tris[0].normal;
-	delete this->tris;
-	delete this->_indices;
-}
+	if (!angles) return;
 
-//------------------------------------------------------------------------------
-unsigned int STLMesh::vert_count()
-{
-	return tri_count * 3;
-}
+	for (int k = 0; k < 3; k++)
+	{
+		float dot = 0, la = 0, lb = 0;
 
-//------------------------------------------------------------------------------
-Vertex* STLMesh::verts()
-{
-	return nullptr;
+		for (int i = 0; i < 3; i++)
+		{
+			float ea = batch.p[(k + 1) % 3][i][f] - batch.p[k][i][f];
+			float eb = batch.p[(k + 2) % 3][i][f] - batch.p[k][i][f];
+			dot += ea * eb;
+			la += ea * ea;
+			lb += eb * eb;
+		}
+
+		float lens = sqrtf(la * lb);
+		batch.cosine[k][f] = lens > 0 ? std::max(-1.f, std::min(1.f, dot / lens)) : 1;
+	}
 }
 
 //------------------------------------------------------------------------------
-Plane::Plane(float size)
+#ifdef __SSE2__
+// face_frame() for the four faces starting at f
+static void face_frames_sse(FaceBatch& batch, size_t f, size_t t, FaceFrames& faces, bool angles)
 {
-	Vertex verts[] = {
-		{ { -1 * size, 1 * size,  0 } },
-		{ {  1 * size, 1 * size,  0 } },
-		{ { -1 * size,-1 * size,  0 } },
+	const __m128 sign_bit = _mm_set1_ps(-0.f), one = _mm_set1_ps(1);
+	__m128 p[3][3], e1[3], e2[3];
 
-		{ { -1 * size,-1 * size,  0 } },
-		{ {  1 * size, 1 * size,  0 } },
-		{ {  1 * size,-1 * size,  0 } },
-	};
+	for (int k = 0; k < 3; k++)
+	for (int i = 0; i < 3; i++)
+	{
+		p[k][i] = _mm_loadu_ps(&batch.p[k][i][f]);
+	}
 
-	for(int i = 6; i--;)
+	for (int i = 0; i < 3; i++)
 	{
-		verts[i].normal[2] = 1;
-		verts[i].texture[0] = 10 * ((verts[i].position[0] / size) + 1) / 2;
-		verts[i].texture[1] = 10 * ((verts[i].position[1] / size) + 1) / 2;
-		vertices.push_back(verts[i]);
+		e1[i] = _mm_sub_ps(p[1][i], p[0][i]);
+		e2[i] = _mm_sub_ps(p[2][i], p[0][i]);
 	}
 
-	// compute_tangents();
-}
+	_mm_storeu_ps(&faces.normal[0][t], _mm_sub_ps(_mm_mul_ps(e1[1], e2[2]), _mm_mul_ps(e1[2], e2[1])));
+	_mm_storeu_ps(&faces.normal[1][t], _mm_sub_ps(_mm_mul_ps(e1[2], e2[0]), _mm_mul_ps(e1[0], e2[2])));
+	_mm_storeu_ps(&faces.normal[2][t], _mm_sub_ps(_mm_mul_ps(e1[0], e2[1]), _mm_mul_ps(e1[1], e2[0])));
 
-//------------------------------------------------------------------------------
-Plane::Plane(float size, int subdivisions)
-{
-	float dx = 1 / (float)subdivisions;
-	float dy = 1 / (float)subdivisions;
+	__m128 u0 = _mm_loadu_ps(&batch.uv[0][0][f]), v0 = _mm_loadu_ps(&batch.uv[0][1][f]);
+	__m128 du1 = _mm_sub_ps(_mm_loadu_ps(&batch.uv[1][0][f]), u0), dv1 = _mm_sub_ps(_mm_loadu_ps(&batch.uv[1][1][f]), v0);
+	__m128 du2 = _mm_sub_ps(_mm_loadu_ps(&batch.uv[2][0][f]), u0), dv2 = _mm_sub_ps(_mm_loadu_ps(&batch.uv[2][1][f]), v0);
+	__m128 det = _mm_sub_ps(_mm_mul_ps(du1, dv2), _mm_mul_ps(du2, dv1));
+	__m128 flip = _mm_and_ps(_mm_cmplt_ps(det, _mm_setzero_ps()), sign_bit);
 
-	for (int i = 0; i < subdivisions; i++)
-	for (int j = 0; j < subdivisions; j++)
+	__m128 tan[3], len2 = _mm_setzero_ps();
+	for (int i = 0; i < 3; i++)
 	{
-		float x = dx * i - 0.5f, y = dy * j - 0.5f;
-		Vertex v = {
-			.position = { x * size, 0, y * size },
-			.normal = { 0, 1, 0 },
-			.tangent = { 1, 0, 0 },
-			.texture = { dx * i * size, dy * j * size, 0 }
-		};
-
-		vertices.push_back(v);
+		tan[i] = _mm_sub_ps(_mm_mul_ps(e1[i], dv2), _mm_mul_ps(e2[i], dv1));
+		tan[i] = _mm_xor_ps(tan[i], flip);
+		len2 = _mm_add_ps(len2, _mm_mul_ps(tan[i], tan[i]));
 	}
 
-	for (int y = 0; y < subdivisions - 1; y++)
-	for (int x = 0; x < subdivisions - 1; x++)
-	{
-		int i = x + y * (subdivisions);
-		int j = x + (y + 1) * (subdivisions);
-		indices.push_back(i);
-		indices.push_back(i + 1);
-		indices.push_back(j);
+	__m128 usable = _mm_and_ps(
+		_mm_cmpgt_ps(_mm_andnot_ps(sign_bit, det), _mm_set1_ps(1e-12f)),
+		_mm_cmpgt_ps(len2, _mm_set1_ps(1e-24f))
+	);
 
-		indices.push_back(j + 1);
-		indices.push_back(j);
-		indices.push_back(i + 1);
+	_mm_storeu_ps(&faces.handedness[t], _mm_or_ps(one, _mm_and_ps(usable, flip)));
+
+	__m128 edge_len2 = _mm_setzero_ps();
+	for (int i = 0; i < 3; i++)
+	{
+		edge_len2 = _mm_add_ps(edge_len2, _mm_mul_ps(e1[i], e1[i]));
+		tan[i] = _mm_or_ps(_mm_and_ps(usable, tan[i]), _mm_andnot_ps(usable, e1[i]));
 	}
-}
-//------------------------------------------------------------------------------
+	len2 = _mm_or_ps(_mm_and_ps(usable, len2), _mm_andnot_ps(usable, edge_len2));
 
-Plane::Plane(Vec3 c0, Vec3 c1)
-{
-	Vertex verts[4] = {
-		{ { c0.x, c0.y, c0.z } },
-		{ { c1.x, c0.y, c1.z } },
-		{ { c0.x, c1.y, c0.z } },
-		{ { c1.x, c1.y, c1.z } },
-	};
+	__m128 inv = _mm_div_ps(one, _mm_sqrt_ps(_mm_max_ps(len2, _mm_set1_ps(1e-30f))));
+	for (int i = 0; i < 3; i++)
+	{
+		_mm_storeu_ps(&faces.tangent[i][t], _mm_mul_ps(tan[i], inv));
+	}
 
-	vec3_t normal, d[2];
-	vec3_sub(d[0].v, verts[0].position, verts[1].position);
-	vec3_sub(d[1].v, verts[0].position, verts[2].position);
-	vec3_mul_cross(normal.v, d[0].v, d[1].v);
-	vec3_norm(verts[0].normal, normal.v);
+	if (!angles) return;
 
-	for(int i = 4; i--;)
+	for (int k = 0; k < 3; k++)
 	{
-		if (i > 0)
+		__m128 dot = _mm_setzero_ps(), la = dot, lb = dot;
+
+		for (int i = 0; i < 3; i++)
 		{
-			vec3_copy(verts[i].normal, verts[0].normal);
+			__m128 ea = _mm_sub_ps(p[(k + 1) % 3][i], p[k][i]);
+			__m128 eb = _mm_sub_ps(p[(k + 2) % 3][i], p[k][i]);
+			dot = _mm_add_ps(dot, _mm_mul_ps(ea, eb));
+			la = _mm_add_ps(la, _mm_mul_ps(ea, ea));
+			lb = _mm_add_ps(lb, _mm_mul_ps(eb, eb));
 		}
 
-		printf("%f %f %f\n", verts[i].normal[0], verts[i].normal[1], verts[i].normal[2]);
+		__m128 lens = _mm_sqrt_ps(_mm_mul_ps(la, lb));
+		__m128 cosine = _mm_max_ps(_mm_set1_ps(-1), _mm_min_ps(one, _mm_div_ps(dot, lens)));
+		__m128 valid = _mm_cmpgt_ps(lens, _mm_setzero_ps());
 
-		verts[i].texture[0] = 10 * ((verts[i].position[0]) + 1) / 2;
-		verts[i].texture[1] = 10 * ((verts[i].position[1]) + 1) / 2;
-		vertices.push_back(verts[i]);
+		_mm_storeu_ps(&batch.cosine[k][f], _mm_or_ps(_mm_and_ps(valid, cosine), _mm_andnot_ps(valid, one)));
 	}
-
-	indices.push_back(0);
-	indices.push_back(1);
-	indices.push_back(2);
-
-	indices.push_back(2);
-	indices.push_back(1);
-	indices.push_back(3);
-
-	// compute_tangents();
 }
+#endif
 
 //------------------------------------------------------------------------------
-Heightmap::Heightmap(std::string path, float size, int resolution) :
-           Plane(size, resolution)
+static void face_frames(const Vertex* v, const uint32_t* indices, size_t begin, size_t end, FaceFrames& faces, bool angles)
 {
-	auto texture = TextureFactory::load_texture(path);
-	generate(texture, resolution);
-}
+	FaceBatch batch;
 
-//------------------------------------------------------------------------------
-Heightmap::Heightmap(Tex texture, float size, int resolution) :
-           Plane(size, resolution)
-{
-	generate(texture, resolution);
-}
+	for (size_t first = begin; first < end; first += FaceBatch::size)
+	{
+		size_t count = std::min(FaceBatch::size, end - first), f = 0;
 
-//------------------------------------------------------------------------------
-void Heightmap::generate(Tex texture, int resolution)
-{
-	struct rgba_t {
-		uint8_t r, g, b, a;
-	};
+		gather_faces(v, indices + first * 3, count, batch);
 
-	struct r_t {
-		uint8_t r;
-	};
+#ifdef __SSE2__
+		for (; f + 4 <= count; f += 4)
+		{
+			face_frames_sse(batch, f, first + f, faces, angles);
+		}
+#endif
 
-	rgba_t textels[resolution * resolution];
-	glBindTexture(GL_TEXTURE_2D, texture);
-	glGetTexImage(
-		GL_TEXTURE_2D,
-		0,
-		GL_RGBA,
-		GL_UNSIGNED_BYTE,
-		(void*)textels
-	);
+		for (; f < count; f++)
+		{
+			face_frame(batch, f, first + f, faces, angles);
+		}
 
-	for (int y = 0; y < resolution; y++)
-	for (int x = 0; x < resolution; x++)
-	{
-		int ti = x + y * (resolution);
-		int vi = x + y * (resolution);
+		if (!angles) continue;
 
-		verts()[vi].position[1] = textels[ti].r / 255.f;
+		for (f = 0; f < count; f++)
+		for (int k = 0; k < 3; k++)
+		{
+			faces.angle[(first + f) * 3 + k] = acosf(batch.cosine[k][f]);
+		}
 	}
-
-	compute_normals();
 }
 
 //------------------------------------------------------------------------------
-Volume::Volume(Vec3 corner0, Vec3 corner1, int divisions)
+void Mesh::compute_normals(int threads)
 {
-	_corners[0] = corner0;
-	_corners[1] = corner1;
-	_divisions = divisions + 1;
+	Vertex* v = verts();
+	size_t triangles = indices.size() / 3;
+	FaceFrames faces(triangles);
 
-	// reserve space for the maximum number of tris that could be allocated
-	// int max_possible_tris = pow(8, divisions) * 5;
-	// int max_possible_verts = max_possible_tris * 3;
-	// vertices.reserve(max_possible_verts);
-}
+	parallel_ranges(triangles, threads, [&](size_t begin, size_t end) {
+		face_frames(v, indices.data(), begin, end, faces, false);
+	});
+
+	VertexCorners corners(indices, vert_count());
+
+	// larger faces pull harder on the vertices they share
+	parallel_ranges(vert_count(), threads, [&](size_t begin, size_t end) {
+		for (size_t i = begin; i < end; i++)
+		{
+			vec3 sum = { 0, 0, 0 };
 
+			for (uint32_t c = corners.offsets[i]; c < corners.offsets[i + 1]; c++)
+			{
+				uint32_t t = corners.corners[c] / 3;
+				for (int j = 3; j--;) sum[j] += faces.normal[j][t];
+			}
+
+			// unreferenced or degenerate, keep what was there
+			if (vec3_len(sum) > 0)
+			{
+				vec3_norm(v[i].normal, sum);
+			}
+		}
+	});
+}
 //------------------------------------------------------------------------------
-void Volume::generate(float(*density_at)(vec3 loc))
-{
-	#include "mc_luts.hpp"
 
-	float div = _divisions;
+void Mesh::compute_tangents(int threads)
+{
+	Vertex* v = verts();
+	size_t triangles = indices.size() / 3;
+	FaceFrames faces(triangles);
 
-	Vec3& p0 = _corners[0];
-	Vec3& p1 = _corners[1];
-	Vec3 block_delta = (p1 - p0);
-	Vec3 voxel_delta = block_delta / div;
+	parallel_ranges(triangles, threads, [&](size_t begin, size_t end) {
+		face_frames(v, indices.data(), begin, end, faces, true);
+	});
 
-	for (int x = _divisions; x--;)
-	for (int y = _divisions; y--;)
-	for (int z = _divisions; z--;)
-	{
-		Vec3 voxel_index(x, y, z);
-		Vec3 p[8];  // voxel corners
-		float d[8]; // densities at each corner
-		uint8_t voxel_case = 0;
-
-		Vec3 c[8] = {
-			{ 0.f, 0.f, 0.f },
-			{ 0.f, 1.f, 0.f },
-			{ 1.f, 1.f, 0.f },
-			{ 1.f, 0.f, 0.f },
-
-			{ 0.f, 0.f, 1.f },
-			{ 0.f, 1.f, 1.f },
-			{ 1.f, 1.f, 1.f },
-			{ 1.f, 0.f, 1.f },
-		};
+	VertexCorners corners(indices, vert_count());
 
-		// compute positions of the corners for voxel x,y,z as well
-		// as the case for the voxel
-		for (int i = 8; i--;)
+	// as MikkTSpace does, each corner's face tangent is projected onto the
+	// vertex's tangent plane, normalized, then weighted by the corner angle
+	parallel_ranges(vert_count(), threads, [&](size_t begin, size_t end) {
+		for (size_t i = begin; i < end; i++)
 		{
-			c[i] *= voxel_delta;
-			p[i] = p0 + (voxel_delta * voxel_index) + c[i];
-			d[i] = density_at(p[i].v);
+			float* n = v[i].normal;
+			vec3 sum = { 0, 0, 0 };
+			float weight = 0, handedness = 0;
 
-			if (d[i] <= 0)
+			for (uint32_t c = corners.offsets[i]; c < corners.offsets[i + 1]; c++)
 			{
-				voxel_case |= (1 << i);
-			}
-		}
+				uint32_t corner = corners.corners[c], t = corner / 3;
+				vec3 tan = { faces.tangent[0][t], faces.tangent[1][t], faces.tangent[2][t] };
+				vec3 along;
 
-		// compute lerp weights between verts for each edge
-		float w[12];
-		for (int i = 0; i < 12; ++i)
-		{
-			int e_i = tri_edge_list_case[voxel_case][i];
+				vec3_scale(along, n, vec3_mul_inner(n, tan));
+				vec3_sub(tan, tan, along);
 
-			if (e_i == -1) break;
+				float len = vec3_len(tan);
+				if (len <= 0) continue;
 
-			// v0 * w + v1 * (1 - w)
-			// w = 0.5
-			// -1 * w + 1 * (1 - w) = 0
-			//
-			// d0 * w + d1 * (1 - w) = 0
-			// d0 * w + d1 - d1 * w = 0
-			// (d0 * w - d1 * w) / w = -d1 / w
-			// d0 - d1 = -d1 / w
-			// -d1 / (d0 - d1) = w
+				vec3_scale(tan, tan, faces.angle[corner] / len);
+				vec3_add(sum, sum, tan);
+				weight += faces.angle[corner];
+				handedness += faces.angle[corner] * faces.handedness[t];
+			}
 
-			int p0_i = edge_list[e_i][0];
-			int p1_i = edge_list[e_i][1];
+			// the faces around the vertex vote on its handedness
+			v[i].tangent[3] = handedness < 0 ? -1 : 1;
 
-			// solve for the weight that will lerp between
-			w[i] = d[p0_i] / (d[p0_i] - d[p1_i]);
+			// mirrored uvs meeting at a vertex can cancel out entirely
+			if (vec3_len(sum) > weight * 1e-3f)
+			{
+				vec3_norm(v[i].tangent, sum);
+				continue;
+			}
 
-			Vertex v = {};
-			Vec3 _p = p[p1_i] * w[i] + p[p0_i] * (1 - w[i]);
-			vec3_copy(v.position, _p.v);
+			// nothing usable, any direction in the tangent plane will do
+			vec3 axis = { 1, 0, 0 }, side;
+			if (fabsf(n[0]) > 0.9f)
+			{
+				axis[0] = 0;
+				axis[1] = 1;
+			}
 
-			indices.push_back(vertices.size());
-			vertices.push_back(v);
+			vec3_mul_cross(side, axis, n);
+			vec3_mul_cross(sum, n, side);
+			vec3_norm(v[i].tangent, vec3_len(sum) > 0 ? sum : axis);
 		}
+	});
+}
+//------------------------------------------------------------------------------
 
-	}
+const Bounds& Mesh::bounds()
+{
+	if(!_has_bounds) compute_bounds();
+	return _bounds;
+}
 
-	// use the gradient of the density function to compute the
-	// normal vector for each vertex
-	for (int i = 0; i < vertices.size(); i++)
-	{
-		const float s = 0.1;
-		vec3 grad;
-		vec3 deltas[3][2] = {
-			{{ s, 0, 0 }, { -s, 0, 0 }},
-			{{ 0, s, 0 }, { 0, -s, 0 }},
-			{{ 0, 0, s }, { 0,  0, -s }},
-		};
-		Vertex& v = vertices[i];
+//------------------------------------------------------------------------------
+void Mesh::compute_bounds()
+{
+	Vertex* v = verts();
+	unsigned int count = vert_count();
 
-		for (int j = 3; j--;)
-		{
-			vec3 samples[2];
-			vec3_add(samples[0], v.position, deltas[j][0]);
-			vec3_add(samples[1], v.position, deltas[j][1]);
-			grad[j] = density_at(samples[0]) - density_at(samples[1]);
-		}
+	_bounds = Bounds();
+	_has_bounds = true;
+	if(!count) return;
 
-		vec3_norm(v.normal, grad);
+#ifdef __SSE2__
+	// each load takes the normal's x along in the last lane, it's ignored
+	__m128 lo = _mm_loadu_ps(v[0].position), hi = lo;
+	for(unsigned int i = 1; i < count; ++i)
+	{
+		__m128 p = _mm_loadu_ps(v[i].position);
+		lo = _mm_min_ps(lo, p);
+		hi = _mm_max_ps(hi, p);
 	}
-}
+
+	float l[4], h[4];
+	_mm_storeu_ps(l, lo);
+	_mm_storeu_ps(h, hi);
+	_bounds.min = Vec3(l[0], l[1], l[2]);
+	_bounds.max = Vec3(h[0], h[1], h[2]);
+#else
+	_bounds.min = _bounds.max = Vec3(v[0].position[0], v[0].position[1], v[0].position[2]);
+	for(unsigned int i = 1; i < count; ++i)
+	for(int j = 3; j--;)
+	{
+		_bounds.min.v[j] = std::min(_bounds.min.v[j], v[i].position[j]);
+		_bounds.max.v[j] = std::max(_bounds.max.v[j], v[i].position[j]);
+	}
+#endif
+
+	// sphere about the box's center, not minimal but never far off
+	float radius2 = 0;
+	_bounds.center = (_bounds.min + _bounds.max) * 0.5f;
+	for(unsigned int i = 0; i < count; ++i)
+	{
+		vec3 d;
+		vec3_sub(d, v[i].position, _bounds.center.v);
+		radius2 = std::max(radius2, vec3_mul_inner(d, d));
+	}
+	_bounds.radius = sqrtf(radius2);
+}
+
 //------------------------------------------------------------------------------
-//     ___  ___    _
-//    / _ \| _ )_ | |
-//   | (_) | _ \ || |
-//    \___/|___/\__/
-//
-enum ObjLineType {
-	COMMENT = 0,
-	POSITION,
-	TEXTURE,
-	NORMAL,
-	PARAMETER,
-	FACE,
-	UNKNOWN,
-};
+Vec3 Mesh::min_position()
+{
+	return bounds().min;
+}
 
+//------------------------------------------------------------------------------
+Vec3 Mesh::max_position()
+{
+	return bounds().max;
+}
 
-struct ObjLine {
-	ObjLineType type;
-	char str[1024];
-	union {
-		vec3 position;
-		vec3 texture;
-		vec3 normal;
-		vec3 parameter;
-		struct {
-			int pos_idx[3], tex_idx[3], norm_idx[3];
-		} face;
-	};
-};
 
 //------------------------------------------------------------------------------
-static int get_line(int fd, char* line)
+Vec3 Mesh::box_dimensions()
+{
+	Vec3 min = min_position();
+	Vec3 max = max_position();
+	return max - min;
+}
+//------------------------------------------------------------------------------
+// Simulate a FIFO post-transform cache over inds. ACMR is misses per
+// triangle, ATVR is misses per referenced vertex. 0.5 and 1.0 are the
+// ideals for large regular meshes
+static void vertex_cache_stats(const std::vector<uint32_t>& inds,
+                               size_t vert_count,
+                               int cache_size,
+                               float& acmr,
+                               float& atvr)
 {
-	int size = 0;
-	while(read(fd, line + size, 1))
+	std::vector<int> cache(cache_size, -1);
+	std::vector<bool> referenced(vert_count, false);
+	size_t misses = 0, unique = 0;
+	int head = 0;
+
+	for(auto i : inds)
 	{
-		if(line[size] == '\n') break;
-		++size;
-	}
+		if(std::find(cache.begin(), cache.end(), (int)i) == cache.end())
+		{
+			cache[head] = i;
+			head = (head + 1) % cache_size;
+			++misses;
+		}
 
-	line[size] = '\0';
+		if(!referenced[i])
+		{
+			referenced[i] = true;
+			++unique;
+		}
+	}
 
-	return size;
+	acmr = inds.size() ? misses / (inds.size() / 3.f) : 0;
+	atvr = unique ? misses / (float)unique : 0;
 }
-
 //------------------------------------------------------------------------------
-bool parse_line(int fd, ObjLine& line)
+
+VertexCacheReport Mesh::optimize(int cache_size)
 {
-	char *save_ptr = nullptr;
-	line.type = UNKNOWN;
+	VertexCacheReport report = {};
+	const size_t vert_count = vertices.size();
+	const size_t tri_count = indices.size() / 3;
 
-	if(get_line(fd, line.str) == 0)
+	if(tri_count == 0 || indices.size() % 3)
 	{
-		return false;
+		return report;
 	}
 
-	char* token = strtok_r(line.str, " ", &save_ptr);
-	if(!token) return false;
+	vertex_cache_stats(indices, vert_count, cache_size, report.acmr_before, report.atvr_before);
 
-	// Determine the tag of the line
-	const char* tag[] = { R"(#)", R"(v)", R"(vt)", R"(vn)", R"(vp)", R"(f)", nullptr };
-	for(int i = 0; tag[i]; ++i)
+	// vertex -> triangle adjacency, packed as offsets into one list
+	std::vector<uint32_t> adj_offset(vert_count + 1, 0), adj_tris(indices.size());
+	std::vector<int> live(vert_count, 0);
+	for(auto i : indices) ++adj_offset[i + 1];
+	for(size_t v = 0; v < vert_count; ++v)
 	{
-		if(strcmp(tag[i], token) == 0)
+		live[v] = adj_offset[v + 1];
+		adj_offset[v + 1] += adj_offset[v];
+	}
+	{
+		std::vector<uint32_t> fill(adj_offset.begin(), adj_offset.end() - 1);
+		for(size_t i = 0; i < indices.size(); ++i)
 		{
-			line.type = (ObjLineType)i;
-			break;
+			adj_tris[fill[indices[i]]++] = i / 3;
 		}
 	}
 
-	float* v;
-	int vec_size = 0;
-	switch (line.type)
+	// Tipsify (Sander, Nehab and Barczak 2007). Fan around a vertex, then
+	// move to the candidate most likely to still be in the cache. Every
+	// time the walk has to jump (a dead end) a new cluster starts, and
+	// those clusters are the units reordered for overdraw below
+	std::vector<uint32_t> tris_out;
+	std::vector<size_t> clusters;
+	std::vector<int> stamp(vert_count, 0);
+	std::vector<bool> emitted(tri_count, false);
+	std::vector<uint32_t> dead_end;
+	int time = cache_size + 1;
+	size_t cursor = 0;
+	int fan = 0;
+
+	tris_out.reserve(tri_count);
+	clusters.push_back(0);
+
+	while(fan >= 0)
 	{
-		case COMMENT:
-			break;
-		case POSITION:
-			v = line.position;
-			vec_size = 3;
-			break;
-		case TEXTURE:
-			v = line.texture;
-			vec_size = 2;
-			break;
-		case NORMAL:
-			v = line.normal;
-			vec_size = 3;
-			break;
-		case PARAMETER:
-			v = line.parameter;
-			vec_size = 3;
-			break;
-		case FACE:
-		bzero(&line.face, sizeof(line.face));
-		for(int i = 0; i < 3; ++i)
-		{
-			token = strtok_r(nullptr, " ", &save_ptr);
-			if(!token) break;
+		std::vector<uint32_t> candidates;
 
-			char* idx_token = token;
-			for(int j = strlen(idx_token); j--;)
-			{
-				if(idx_token[j] == '/') idx_token[j] = '\0';
-			}
+		for(uint32_t a = adj_offset[fan]; a < adj_offset[fan + 1]; ++a)
+		{
+			uint32_t t = adj_tris[a];
+			if(emitted[t]) continue;
 
 			for(int j = 0; j < 3; ++j)
 			{
-				if(*idx_token != '\0') switch (j)
+				uint32_t v = indices[t * 3 + j];
+				dead_end.push_back(v);
+				candidates.push_back(v);
+				--live[v];
+
+				if(time - stamp[v] > cache_size)
 				{
-					case 0:
-						sscanf(idx_token, "%d", &line.face.pos_idx[i]);
-						break;
-					case 1:
-						sscanf(idx_token, "%d", &line.face.tex_idx[i]);
-						break;
-					case 2:
-						sscanf(idx_token, "%d", &line.face.norm_idx[i]);
-						break;
+					stamp[v] = time++;
 				}
+			}
+
+			emitted[t] = true;
+			tris_out.push_back(t);
+		}
+
+		// pick the next fanning vertex among the candidates still in cache
+		int next = -1, best = -1;
+		for(auto v : candidates)
+		{
+			if(live[v] <= 0) continue;
 
-				idx_token += strlen(idx_token) + 1;
+			int priority = 0;
+			if(time - stamp[v] + 2 * live[v] <= cache_size)
+			{
+				priority = time - stamp[v];
 			}
 
-			// printf("%d/%d/%d\n", line.face.pos_idx[i], line.face.tex_idx[i], line.face.norm_idx[i]);
+			if(priority > best)
+			{
+				best = priority;
+				next = v;
+			}
 		}
-			break;
-		default:;
+
+		if(next == -1)
+		{
+			while(!dead_end.empty() && next == -1)
+			{
+				uint32_t d = dead_end.back();
+				dead_end.pop_back();
+				if(live[d] > 0) next = d;
+			}
+
+			for(; next == -1 && cursor < vert_count; ++cursor)
+			{
+				if(live[cursor] > 0) next = cursor;
+			}
+
+			if(tris_out.size() > clusters.back())
+			{
+				clusters.push_back(tris_out.size());
+			}
+		}
+
+		fan = next;
 	}
 
-	// Read the vector selected above
-	for(int i = 0; i < vec_size; ++i)
+	if(clusters.back() != tris_out.size())
 	{
-		token = strtok_r(nullptr, " ", &save_ptr);
-		// printf("type: %d TOK: '%s' %d\n", line.type, token, vec_size);
-		sscanf(token, "%f", v + i);
+		clusters.push_back(tris_out.size());
 	}
 
-	return true;
+	// Overdraw: draw clusters facing away from the mesh's centroid first,
+	// they're the most likely to occlude the rest
+	vec3 centroid = {};
+	for(auto& v : vertices) vec3_add(centroid, centroid, v.position);
+	vec3_scale(centroid, centroid, 1.f / std::max<size_t>(vert_count, 1));
+
+	struct Cluster {
+		size_t start, end;
+		float facing;
+	};
+	std::vector<Cluster> ordered;
+
+	for(size_t c = 0; c + 1 < clusters.size(); ++c)
+	{
+		vec3 normal = {}, center = {};
+		float area = 0;
+
+		for(size_t i = clusters[c]; i < clusters[c + 1]; ++i)
+		{
+			const uint32_t* tri = &indices[tris_out[i] * 3];
+			float* p[3] = {
+				vertices[tri[0]].position,
+				vertices[tri[1]].position,
+				vertices[tri[2]].position
+			};
+			vec3 e[2], n, mid;
+
+			vec3_sub(e[0], p[1], p[0]);
+			vec3_sub(e[1], p[2], p[0]);
+			vec3_mul_cross(n, e[0], e[1]);
+			float a = vec3_len(n);
+
+			vec3_add(mid, p[0], p[1]);
+			vec3_add(mid, mid, p[2]);
+			vec3_scale(mid, mid, a / 3.f);
+
+			vec3_add(normal, normal, n);
+			vec3_add(center, center, mid);
+			area += a;
+		}
+
+		if(area > 0) vec3_scale(center, center, 1.f / area);
+		vec3_sub(center, center, centroid);
+
+		float len = vec3_len(normal);
+		float facing = len > 0 ? vec3_mul_inner(normal, center) / len : 0;
+
+		ordered.push_back({ clusters[c], clusters[c + 1], facing });
+	}
+
+	std::stable_sort(ordered.begin(), ordered.end(), [](const Cluster& a, const Cluster& b) {
+		return a.facing > b.facing;
+	});
+
+	std::vector<uint32_t> new_indices;
+	new_indices.reserve(indices.size());
+	for(auto& c : ordered)
+	for(size_t i = c.start; i < c.end; ++i)
+	{
+		const uint32_t* tri = &indices[tris_out[i] * 3];
+		new_indices.insert(new_indices.end(), tri, tri + 3);
+	}
+
+	// Vertex fetch: lay vertices out in the order they're first referenced.
+	// Vertices no triangle uses are dropped
+	std::vector<uint32_t> remap(vert_count, 0xFFFFFFFF);
+	std::vector<Vertex> new_vertices;
+	new_vertices.reserve(vert_count);
+	for(auto& i : new_indices)
+	{
+		if(remap[i] == 0xFFFFFFFF)
+		{
+			remap[i] = new_vertices.size();
+			new_vertices.push_back(vertices[i]);
+		}
+
+		i = remap[i];
+	}
+
+	// simplified levels index the same vertices, they follow them to
+	// their new places. Their triangles keep the order they were built in
+	for(auto& level : lod_indices)
+	for(auto& i : level)
+	{
+		if(remap[i] == 0xFFFFFFFF)
+		{
+			remap[i] = new_vertices.size();
+			new_vertices.push_back(vertices[i]);
+		}
+
+		i = remap[i];
+	}
+
+	indices.swap(new_indices);
+	vertices.swap(new_vertices);
+
+	vertex_cache_stats(indices, vertices.size(), cache_size, report.acmr_after, report.atvr_after);
+
+	return report;
+}
+
+
+//------------------------------------------------------------------------------
+static inline bool txt_is_space(char c)
+{
+	return c == ' ' || c == '\t' || c == '\r' || c == '\n';
+}
+
+//------------------------------------------------------------------------------
+static inline const char* txt_skip_space(const char* c, const char* end)
+{
+	while(c < end && txt_is_space(*c)) ++c;
+	return c;
+}
+
+//------------------------------------------------------------------------------
+static inline const char* txt_skip_token(const char* c, const char* end)
+{
+	while(c < end && !txt_is_space(*c)) ++c;
+	return c;
+}
+
+//------------------------------------------------------------------------------
+static const char* txt_parse_int(const char* c, const char* end, int& i)
+{
+	bool negative = false;
+	i = 0;
+
+	if(c < end && (*c == '-' || *c == '+'))
+	{
+		negative = *c == '-';
+		++c;
+	}
+
+	for(; c < end && *c >= '0' && *c <= '9'; ++c)
+	{
+		i = i * 10 + (*c - '0');
+	}
+
+	if(negative) i = -i;
+
+	return c;
 }
 
 //------------------------------------------------------------------------------
-OBJMesh::OBJMesh(int fd)
+static const char* txt_parse_float(const char* c, const char* end, float& f)
 {
-	_min = _max = nullptr;
+	// powers of ten that are exactly representable as doubles
+	static const double pow10[] = {
+		1e0,  1e1,  1e2,  1e3,  1e4,  1e5,  1e6,  1e7,  1e8,  1e9,  1e10, 1e11,
+		1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22
+	};
+
+	const char* start = c;
+	bool negative = false;
+	uint64_t mantissa = 0;
+	int significant = 0, exponent = 0, digits = 0;
+
+	if(c < end && (*c == '-' || *c == '+'))
+	{
+		negative = *c == '-';
+		++c;
+	}
 
-	std::map<std::string, uint16_t> index_map;
+	for(; c < end && *c >= '0' && *c <= '9'; ++c, ++digits)
+	{
+		mantissa = mantissa * 10 + (*c - '0');
+		significant += mantissa != 0;
+	}
 
-	ObjLine l = {};
-	while(parse_line(fd, l))
+	if(c < end && *c == '.')
 	{
-		switch (l.type)
+		for(++c; c < end && *c >= '0' && *c <= '9'; ++c, ++digits)
 		{
-			case COMMENT:
-				// printf("%s\n", l.str);
-				break;
-			case POSITION:
+			mantissa = mantissa * 10 + (*c - '0');
+			significant += mantissa != 0;
+			--exponent;
+		}
+	}
+
+	if(digits && c < end && (*c == 'e' || *c == 'E'))
+	{
+		int e = 0;
+		c = txt_parse_int(c + 1, end, e);
+		exponent += e;
+	}
+
+	// Fast path: the mantissa and the power of ten are both exact doubles,
+	// so one multiply or divide yields the correctly rounded value. Anything
+	// else (long mantissas, huge exponents, nan, inf) goes through strtof.
+	if(digits && significant <= 15 && exponent >= -22 && exponent <= 22)
+	{
+		double d = (double)mantissa;
+		d = exponent < 0 ? d / pow10[-exponent] : d * pow10[exponent];
+		f = (float)(negative ? -d : d);
+		return c;
+	}
+
+	char buf[64] = {};
+	c = txt_skip_token(start, end);
+	memcpy(buf, start, std::min<size_t>(c - start, sizeof(buf) - 1));
+	f = strtof(buf, nullptr);
+
+	return c;
+}
+
+//------------------------------------------------------------------------------
+static const char* txt_parse_vec(const char* c, const char* end, float* v, int size)
+{
+	for(int i = 0; i < size; ++i)
+	{
+		c = txt_skip_space(c, end);
+		v[i] = 0;
+		if(c < end) c = txt_parse_float(c, end, v[i]);
+	}
+
+	return c;
+}
+
+//------------------------------------------------------------------------------
+//    _    ___  ___
+//   | |  / _ \|   \ ___
+//   | |_| (_) | |) (_-<
+//   |____\___/|___//__/
+//
+// Symmetric 4x4 error quadric (Garland and Heckbert 1997), upper triangle
+// only. Doubles, since the d^2 terms of large meshes lose too much in float
+struct Quadric {
+	double a2, ab, ac, ad, b2, bc, bd, c2, cd, d2;
+	double area;
+
+	void add_plane(const vec3 n, float d, float w)
+	{
+		a2 += w * n[0] * n[0]; ab += w * n[0] * n[1]; ac += w * n[0] * n[2]; ad += w * n[0] * d;
+		b2 += w * n[1] * n[1]; bc += w * n[1] * n[2]; bd += w * n[1] * d;
+		c2 += w * n[2] * n[2]; cd += w * n[2] * d;
+		d2 += w * d * d;
+		area += w;
+	}
+
+	void add(const Quadric& q)
+	{
+		a2 += q.a2; ab += q.ab; ac += q.ac; ad += q.ad;
+		b2 += q.b2; bc += q.bc; bd += q.bd;
+		c2 += q.c2; cd += q.cd;
+		d2 += q.d2;
+		area += q.area;
+	}
+
+	double error(const float* p) const
+	{
+		double x = p[0], y = p[1], z = p[2];
+		return a2 * x * x + 2 * ab * x * y + 2 * ac * x * z + 2 * ad * x +
+		       b2 * y * y + 2 * bc * y * z + 2 * bd * y +
+		       c2 * z * z + 2 * cd * z +
+		       d2;
+	}
+};
+
+//------------------------------------------------------------------------------
+std::vector<uint32_t> Mesh::simplify(float target_ratio)
+{
+	const unsigned int vert_count = this->vert_count();
+	const Vertex* v = verts();
+	std::vector<uint32_t> inds;
+
+	if(!indices.empty())
+	{
+		inds = indices;
+	}
+	else
+	{
+		// baked meshes only have their indices in the mapped blob
+		std::vector<uint16_t> scratch;
+		const void* buf = index_buffer(scratch);
+		if(index_type() == GL_UNSIGNED_INT)
+		{
+			const uint32_t* i32 = (const uint32_t*)buf;
+			inds.assign(i32, i32 + index_count());
+		}
+		else
+		{
+			const uint16_t* i16 = (const uint16_t*)buf;
+			inds.assign(i16, i16 + index_count());
+		}
+	}
+
+	size_t tri_count = inds.size() / 3;
+	const size_t target = std::max<size_t>(1, tri_count * target_ratio);
+
+	if(inds.size() % 3 || tri_count <= target)
+	{
+		return inds;
+	}
+
+	// Collapses work on positions rather than vertices, so that split
+	// vertices along a UV seam or hard edge are seen as one point
+	std::vector<uint32_t> pid(vert_count), pos_vert;
+	{
+		VertexTable table(vert_count);
+		for(unsigned int i = 0; i < vert_count; ++i)
+		{
+			float pos[3] = { v[i].position[0] + 0.f, v[i].position[1] + 0.f, v[i].position[2] + 0.f };
+			uint32_t key[3];
+			memcpy(key, pos, sizeof(key));
+
+			pid[i] = table.find_or_insert(key, pos_vert.size());
+			if(pid[i] == pos_vert.size()) pos_vert.push_back(i);
+		}
+	}
+	const size_t pos_count = pos_vert.size();
+
+	// A position may only be collapsed away if a single vertex lives there
+	// (no seam to tear) and every edge around it is shared by exactly two
+	// triangles (not on a border the simplified mesh would pull open)
+	std::vector<bool> locked(pos_count, false);
+	{
+		std::vector<uint32_t> verts_at(pos_count, 0);
+		for(unsigned int i = 0; i < vert_count; ++i)
+		{
+			if(++verts_at[pid[i]] > 1) locked[pid[i]] = true;
+		}
+
+		std::vector<uint64_t> edges;
+		edges.reserve(inds.size());
+		for(size_t i = 0; i < inds.size(); i += 3)
+		for(int j = 0; j < 3; ++j)
+		{
+			uint64_t a = pid[inds[i + j]], b = pid[inds[i + (j + 1) % 3]];
+			edges.push_back(a < b ? (a << 32 | b) : (b << 32 | a));
+		}
+		std::sort(edges.begin(), edges.end());
+
+		for(size_t i = 0; i < edges.size();)
+		{
+			size_t j = i;
+			while(j < edges.size() && edges[j] == edges[i]) ++j;
+
+			if(j - i != 2)
 			{
-				vec3_t p = { { l.position[0], l.position[1], l.position[2] } };
-				positions.push_back(p);
+				locked[edges[i] >> 32] = locked[edges[i] & 0xFFFFFFFF] = true;
 			}
-				break;
-			case TEXTURE:
+			i = j;
+		}
+	}
+
+	// each position accumulates the area weighted planes of its triangles
+	std::vector<Quadric> quadrics(pos_count, Quadric{});
+	for(size_t i = 0; i < inds.size(); i += 3)
+	{
+		const float* p[3] = { v[inds[i]].position, v[inds[i + 1]].position, v[inds[i + 2]].position };
+		vec3 e[2], n;
+		vec3_sub(e[0], p[1], p[0]);
+		vec3_sub(e[1], p[2], p[0]);
+		vec3_mul_cross(n, e[0], e[1]);
+
+		float len = vec3_len(n);
+		if(len <= 0) continue;
+		vec3_scale(n, n, 1.f / len);
+
+		float d = -vec3_mul_inner(n, p[0]);
+		for(int j = 0; j < 3; ++j)
+		{
+			quadrics[pid[inds[i + j]]].add_plane(n, d, len * 0.5f);
+		}
+	}
+
+	struct Collapse {
+		uint32_t from, to; // positions
+		float cost;
+	};
+
+	std::vector<uint32_t> adj_offset, adj_tris;
+	std::vector<uint32_t> stamp(pos_count, 0);
+	std::vector<bool> touched(pos_count), dead;
+	uint32_t time = 0;
+
+	// Greedy passes. Each pass sorts every candidate edge by cost and then
+	// applies the cheapest collapses whose neighbourhoods don't overlap,
+	// so adjacency only needs rebuilding once per pass
+	while(tri_count > target)
+	{
+		// position -> live triangle adjacency
+		adj_offset.assign(pos_count + 1, 0);
+		for(auto i : inds) ++adj_offset[pid[i] + 1];
+		for(size_t p = 0; p < pos_count; ++p) adj_offset[p + 1] += adj_offset[p];
+		adj_tris.resize(inds.size());
+		{
+			std::vector<uint32_t> fill(adj_offset.begin(), adj_offset.end() - 1);
+			for(size_t i = 0; i < inds.size(); ++i)
 			{
-				vec3_t t = { { l.texture[0], l.texture[1], l.texture[2] } };
-				tex_coords.push_back(t);
+				adj_tris[fill[pid[inds[i]]]++] = i / 3;
 			}
-				break;
-			case NORMAL:
+		}
+
+		std::vector<Collapse> candidates;
+		for(size_t i = 0; i < inds.size(); i += 3)
+		for(int j = 0; j < 3; ++j)
+		{
+			uint32_t vf = inds[i + j], vt = inds[i + (j + 1) % 3];
+			uint32_t from = pid[vf], to = pid[vt];
+
+			// with consistent winding each interior edge is seen once in
+			// each direction, once from each of its two triangles
+			if(locked[from] || from == to) continue;
+
+			Quadric q = quadrics[from];
+			q.add(quadrics[to]);
+			float cost = q.error(v[vt].position);
+
+			// Quadrics only see geometry. Penalize dragging a vertex onto
+			// one whose normal or UV differ, scaled so it's comparable to
+			// the area weighted squared distances above
+			vec3 d;
+			vec3_sub(d, v[vf].position, v[vt].position);
+			float len2 = vec3_mul_inner(d, d);
+			vec3_sub(d, v[vf].texture, v[vt].texture);
+			float attr = (1.f - vec3_mul_inner(v[vf].normal, v[vt].normal)) + vec3_mul_inner(d, d);
+			cost += attr * len2 * quadrics[from].area;
+
+			candidates.push_back({ from, to, cost });
+		}
+
+		if(candidates.empty()) break;
+
+		// only the cheapest third of the edges are eligible each pass, the
+		// rest wait until their surroundings have settled
+		auto cheaper = [](const Collapse& a, const Collapse& b) { return a.cost < b.cost; };
+		auto eligible = candidates.begin() + candidates.size() / 3;
+		std::nth_element(candidates.begin(), eligible, candidates.end(), cheaper);
+		const float cost_limit = eligible->cost;
+		candidates.erase(eligible + 1, candidates.end());
+		std::sort(candidates.begin(), candidates.end(), cheaper);
+
+		touched.assign(pos_count, false);
+		dead.assign(inds.size() / 3, false);
+		size_t collapsed = 0;
+
+		for(auto& c : candidates)
+		{
+			if(c.cost > cost_limit || tri_count <= target) break;
+			if(touched[c.from] || touched[c.to]) continue;
+
+			// Link condition: the positions neighbouring both ends must be
+			// exactly the apexes of the triangles sharing the edge, or the
+			// collapse would pinch the surface into a non-manifold one
+			++time;
+			int shared_tris = 0, shared_verts = 0;
+			for(uint32_t a = adj_offset[c.from]; a < adj_offset[c.from + 1]; ++a)
 			{
-				// printf("n %f %f %f\n", l.normal[0], l.normal[1], l.normal[2] } };
-				vec3_t n = { { l.normal[0], l.normal[1], l.normal[2] } };
-				normals.push_back(n);
+				const uint32_t* tri = &inds[adj_tris[a] * 3];
+				bool has_to = false;
+				for(int j = 0; j < 3; ++j)
+				{
+					stamp[pid[tri[j]]] = time;
+					has_to |= pid[tri[j]] == c.to;
+				}
+				shared_tris += has_to;
 			}
-				break;
-			case PARAMETER:
+			stamp[c.from] = stamp[c.to] = 0;
+			for(uint32_t a = adj_offset[c.to]; a < adj_offset[c.to + 1]; ++a)
 			{
-				vec3_t p = { { l.parameter[0], l.parameter[1], l.parameter[2] } };
-				params.push_back(p);
+				const uint32_t* tri = &inds[adj_tris[a] * 3];
+				for(int j = 0; j < 3; ++j)
+				{
+					uint32_t p = pid[tri[j]];
+					if(stamp[p] == time)
+					{
+						stamp[p] = 0;
+						++shared_verts;
+					}
+				}
 			}
-				break;
-			case FACE:
+			if(shared_verts != shared_tris) continue;
+
+			// reject collapses that would fold a surviving triangle over
+			const float* dest = v[pos_vert[c.to]].position;
+			bool flips = false;
+			for(uint32_t a = adj_offset[c.from]; a < adj_offset[c.from + 1] && !flips; ++a)
 			{
-				for(int i = 0; i < 3; ++i)
+				const uint32_t* tri = &inds[adj_tris[a] * 3];
+				const float* p[3], *q[3];
+				bool has_to = false;
+
+				for(int j = 0; j < 3; ++j)
 				{
-					Vertex v = {};
-					if(l.face.pos_idx[i])  vec3_copy(v.position, positions[l.face.pos_idx[i] - 1].v);
-					if(l.face.tex_idx[i])  vec3_copy(v.texture,  tex_coords[l.face.tex_idx[i] - 1].v);
-					if(l.face.norm_idx[i]) vec3_copy(v.normal,   normals[l.face.norm_idx[i] - 1].v);
+					uint32_t tp = pid[tri[j]];
+					has_to |= tp == c.to;
+					p[j] = v[tri[j]].position;
+					q[j] = tp == c.from ? dest : p[j];
+				}
+				if(has_to) continue;
+
+				vec3 e[2], n0, n1;
+				vec3_sub(e[0], p[1], p[0]);
+				vec3_sub(e[1], p[2], p[0]);
+				vec3_mul_cross(n0, e[0], e[1]);
+				vec3_sub(e[0], q[1], q[0]);
+				vec3_sub(e[1], q[2], q[0]);
+				vec3_mul_cross(n1, e[0], e[1]);
+
+				flips = vec3_mul_inner(n0, n1) <= 0.25f * vec3_len(n0) * vec3_len(n1);
+			}
+			if(flips) continue;
 
-					char token[21] = {};
+			// Apply. 'from' is interior to one seamless patch, so the
+			// triangles sharing the edge agree on which vertex at 'to' the
+			// rest of the fan should now use
+			uint32_t to_vert = pos_vert[c.to];
+			for(uint32_t a = adj_offset[c.from]; a < adj_offset[c.from + 1]; ++a)
+			{
+				uint32_t t = adj_tris[a];
+				uint32_t* tri = &inds[t * 3];
 
-					snprintf(token, sizeof(token), "%u/%u/%u",
-					         l.face.pos_idx[i],
-							 l.face.tex_idx[i],
-							 l.face.norm_idx[i]
-					);
+				for(int j = 0; j < 3; ++j)
+				{
+					touched[pid[tri[j]]] = true;
+					if(pid[tri[j]] == c.to) to_vert = tri[j];
+				}
+			}
+			for(uint32_t a = adj_offset[c.from]; a < adj_offset[c.from + 1]; ++a)
+			{
+				uint32_t t = adj_tris[a];
+				uint32_t* tri = &inds[t * 3];
+				bool has_to = false;
 
-					std::string vert_token(token);
+				for(int j = 0; j < 3; ++j) has_to |= pid[tri[j]] == c.to;
 
-					if (index_map.count(vert_token) == 0)
-					{
-						vertices.push_back(v);
-						index_map[vert_token] = (uint16_t)(vertices.size() - 1);
-					}
+				if(has_to)
+				{
+					dead[t] = true;
+					--tri_count;
+					continue;
+				}
 
-					indices.push_back(index_map[vert_token]);
+				for(int j = 0; j < 3; ++j)
+				{
+					if(pid[tri[j]] == c.from) tri[j] = to_vert;
 				}
 			}
-				break;
-			case UNKNOWN:
-				break;
+
+			quadrics[c.to].add(quadrics[c.from]);
+			++collapsed;
 		}
-	}
 
-	compute_tangents();
+		if(!collapsed) break;
+
+		size_t kept = 0;
+		for(size_t t = 0; t < dead.size(); ++t)
+		{
+			if(dead[t]) continue;
+			memmove(&inds[kept * 3], &inds[t * 3], sizeof(uint32_t) * 3);
+			++kept;
+		}
+		inds.resize(kept * 3);
+	}
+
+	return inds;
+}
+
+//------------------------------------------------------------------------------
+void Mesh::generate_lods(int levels, float ratio)
+{
+	lod_indices.clear();
+
+	size_t last = index_count();
+	float target = 1;
+
+	for(int i = 1; i < levels; ++i)
+	{
+		// each level is simplified from the full mesh, not the previous
+		// level, so errors don't compound down the chain
+		target *= ratio;
+		std::vector<uint32_t> level = simplify(target);
+
+		// stop once the simplifier is stuck on locked features
+		if(level.empty() || level.size() > last * 0.9f) break;
+
+		last = level.size();
+		lod_indices.push_back(std::move(level));
+	}
+}
+
+//------------------------------------------------------------------------------
+unsigned int Mesh::lod_count()
+{
+	return 1 + lod_indices.size();
+}
+
+//------------------------------------------------------------------------------
+std::vector<uint32_t>& Mesh::lod_inds(unsigned int level)
+{
+	assert(level > 0 && level <= lod_indices.size());
+	return lod_indices[level - 1];
+}
+
+//------------------------------------------------------------------------------
+//    ___ _____ _
+//   / __|_   _| |
+//   \__ \ | | | |__
+//   |___/ |_| |____|
+//
+static_assert(sizeof(STLTri) == STL_TRI_SIZE, "STLTri must match the on-disk record");
+
+STLMesh::STLMesh(int fd)
+{
+	tri_count = 0;
+	bzero(header, sizeof(header));
+
+	struct stat st;
+	if(fstat(fd, &st) || st.st_size == 0)
+	{
+		return;
+	}
+
+	size_t size = st.st_size;
+	void* map = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+	if(map == MAP_FAILED)
+	{
+		fprintf(stderr, "Failed to mmap stl file, fd %d\n", fd);
+		return;
+	}
+	madvise(map, size, MADV_SEQUENTIAL);
+
+	const uint8_t* data = (const uint8_t*)map;
+
+	// a binary file's size is fully determined by its triangle count.
+	// Binary files may also begin with 'solid', so check that first
+	bool binary = false;
+	if(size >= STL_HEADER_SIZE + sizeof(tri_count))
+	{
+		memcpy(&tri_count, data + STL_HEADER_SIZE, sizeof(tri_count));
+		binary = size == STL_HEADER_SIZE + sizeof(tri_count) + (size_t)tri_count * STL_TRI_SIZE;
+	}
+
+	// ascii files count their triangles as they're parsed
+	if(!binary) tri_count = 0;
+
+	// identical positions are welded into one vertex, whose normal
+	// accumulates the area weighted normals of every triangle sharing it
+	VertexTable index_map(binary ? tri_count / 2 : 1024);
+	auto add_tri = [&](const float p[3][3]) {
+		vec3 e[2], n;
+		vec3_sub(e[0], p[1], p[0]);
+		vec3_sub(e[1], p[2], p[0]);
+		vec3_mul_cross(n, e[0], e[1]);
+
+		for(int i = 0; i < 3; ++i)
+		{
+			// add 0 to fold -0 into +0 before comparing bits
+			float pos[3] = { p[i][0] + 0.f, p[i][1] + 0.f, p[i][2] + 0.f };
+			uint32_t key[3];
+			memcpy(key, pos, sizeof(key));
+
+			uint32_t index = index_map.find_or_insert(key, vertices.size());
+			if(index == vertices.size())
+			{
+				Vertex v = {};
+				vec3_copy(v.position, pos);
+				vertices.push_back(v);
+			}
+
+			vec3_add(vertices[index].normal, vertices[index].normal, n);
+			indices.push_back(index);
+		}
+	};
+
+	if(binary)
+	{
+		memcpy(header, data, STL_HEADER_SIZE);
+		vertices.reserve(tri_count / 2);
+		indices.reserve(tri_count * 3);
+
+		const uint8_t* rec = data + STL_HEADER_SIZE + sizeof(tri_count);
+		for(uint32_t i = 0; i < tri_count; ++i, rec += STL_TRI_SIZE)
+		{
+			STLTri tri;
+			memcpy(&tri, rec, STL_TRI_SIZE);
+			add_tri(tri.verts);
+		}
+	}
+	else if(size >= 5 && memcmp(data, "solid", 5) == 0)
+	{
+		// ascii: only the 'vertex x y z' lines matter, every three make
+		// a triangle. The facet normals are recomputed like binary ones
+		const char* c = (const char*)data;
+		const char* end = c + size;
+		float p[3][3];
+		int corner = 0;
+
+		for(const char* eol; c < end; c = eol + 1)
+		{
+			// every token and number is bounded by its line
+			eol = (const char*)memchr(c, '\n', end - c);
+			if(!eol) eol = end;
+
+			c = txt_skip_space(c, eol);
+			const char* token = c;
+			c = txt_skip_token(c, eol);
+
+			if(c - token == 6 && memcmp(token, "vertex", 6) == 0)
+			{
+				txt_parse_vec(c, eol, p[corner], 3);
+
+				if(++corner == 3)
+				{
+					add_tri(p);
+					++tri_count;
+					corner = 0;
+				}
+			}
+		}
+	}
+	else
+	{
+		fprintf(stderr, "Unrecognized stl file, fd %d\n", fd);
+	}
+
+	munmap(map, size);
+
+	for(auto& v : vertices)
+	{
+		if(vec3_len(v.normal) > 0)
+		{
+			vec3_norm(v.normal, v.normal);
+		}
+	}
+
+	compute_tangents();
+	compute_bounds();
+}
+
+//------------------------------------------------------------------------------
+Plane::Plane(float size)
+{
+	Vertex verts[] = {
+		{ { -1 * size, 1 * size,  0 } },
+		{ {  1 * size, 1 * size,  0 } },
+		{ { -1 * size,-1 * size,  0 } },
+
+		{ { -1 * size,-1 * size,  0 } },
+		{ {  1 * size, 1 * size,  0 } },
+		{ {  1 * size,-1 * size,  0 } },
+	};
+
+	for(int i = 6; i--;)
+	{
+		verts[i].normal[2] = 1;
+		verts[i].texture[0] = 10 * ((verts[i].position[0] / size) + 1) / 2;
+		verts[i].texture[1] = 10 * ((verts[i].position[1] / size) + 1) / 2;
+		vertices.push_back(verts[i]);
+	}
+
+	// compute_tangents();
+}
+
+//------------------------------------------------------------------------------
+Plane::Plane(float size, int subdivisions)
+{
+	float dx = 1 / (float)subdivisions;
+	float dy = 1 / (float)subdivisions;
+
+	for (int i = 0; i < subdivisions; i++)
+	for (int j = 0; j < subdivisions; j++)
+	{
+		float x = dx * i - 0.5f, y = dy * j - 0.5f;
+		Vertex v = {
+			.position = { x * size, 0, y * size },
+			.normal = { 0, 1, 0 },
+			.tangent = { 1, 0, 0 },
+			.texture = { dx * i * size, dy * j * size, 0 }
+		};
+
+		vertices.push_back(v);
+	}
+
+	for (int y = 0; y < subdivisions - 1; y++)
+	for (int x = 0; x < subdivisions - 1; x++)
+	{
+		int i = x + y * (subdivisions);
+		int j = x + (y + 1) * (subdivisions);
+		indices.push_back(i);
+		indices.push_back(i + 1);
+		indices.push_back(j);
+
+		indices.push_back(j + 1);
+		indices.push_back(j);
+		indices.push_back(i + 1);
+	}
+}
+//------------------------------------------------------------------------------
+
+Plane::Plane(Vec3 c0, Vec3 c1)
+{
+	Vertex verts[4] = {
+		{ { c0.x, c0.y, c0.z } },
+		{ { c1.x, c0.y, c1.z } },
+		{ { c0.x, c1.y, c0.z } },
+		{ { c1.x, c1.y, c1.z } },
+	};
+
+	vec3_t normal, d[2];
+	vec3_sub(d[0].v, verts[0].position, verts[1].position);
+	vec3_sub(d[1].v, verts[0].position, verts[2].position);
+	vec3_mul_cross(normal.v, d[0].v, d[1].v);
+	vec3_norm(verts[0].normal, normal.v);
+
+	for(int i = 4; i--;)
+	{
+		if (i > 0)
+		{
+			vec3_copy(verts[i].normal, verts[0].normal);
+		}
+
+		printf("%f %f %f\n", verts[i].normal[0], verts[i].normal[1], verts[i].normal[2]);
+
+		verts[i].texture[0] = 10 * ((verts[i].position[0]) + 1) / 2;
+		verts[i].texture[1] = 10 * ((verts[i].position[1]) + 1) / 2;
+		vertices.push_back(verts[i]);
+	}
+
+	indices.push_back(0);
+	indices.push_back(1);
+	indices.push_back(2);
+
+	indices.push_back(2);
+	indices.push_back(1);
+	indices.push_back(3);
+
+	// compute_tangents();
+}
+
+//------------------------------------------------------------------------------
+Heightmap::Heightmap(std::string path, float size, int resolution) :
+           Plane(size, resolution)
+{
+	void* data = nullptr;
+	int width, height, depth, bits;
+
+	if (TextureFactory::load_texture_buffer(path, &data, width, height, depth, &bits))
+	{
+		return;
+	}
+
+	// only the first channel is height
+	std::vector<float> heights(width * height);
+	for (int i = 0; i < width * height; i++)
+	{
+		if (bits == 16)
+		{
+			heights[i] = ((uint16_t*)data)[i * depth] / 65535.f;
+		}
+		else
+		{
+			heights[i] = ((uint8_t*)data)[i * depth] / 255.f;
+		}
+	}
+	free(data);
+
+	generate(heights.data(), width, height, resolution, size);
+}
+
+//------------------------------------------------------------------------------
+Heightmap::Heightmap(Tex texture, float size, int resolution) :
+           Plane(size, resolution)
+{
+	GLint width, height;
+
+	glBindTexture(GL_TEXTURE_2D, texture);
+	glGetTexLevelParameteriv(GL_TEXTURE_2D, 0, GL_TEXTURE_WIDTH, &width);
+	glGetTexLevelParameteriv(GL_TEXTURE_2D, 0, GL_TEXTURE_HEIGHT, &height);
+
+	std::vector<float> heights(width * height);
+	glGetTexImage(GL_TEXTURE_2D, 0, GL_RED, GL_FLOAT, heights.data());
+
+	generate(heights.data(), width, height, resolution, size);
+}
+
+//------------------------------------------------------------------------------
+void Heightmap::generate(const float* heights, int width, int height, int resolution, float size)
+{
+	if (resolution < 2 || width < 1 || height < 1) return;
+
+	// Bilinear resample onto the grid, padded by a replicated border so
+	// the filter below never needs to branch at the edges. Image rows run
+	// along the plane's x, columns along its z
+	const int n = resolution, stride = n + 2;
+	std::vector<float> grid(stride * stride);
+	float u_scale = (width - 1) / (float)(n - 1);
+	float v_scale = (height - 1) / (float)(n - 1);
+
+	for (int i = 0; i < n; i++)
+	{
+		float v = i * v_scale;
+		int v0 = std::min((int)v, height - 1), v1 = std::min(v0 + 1, height - 1);
+		float fv = v - v0;
+		const float* row0 = heights + v0 * width;
+		const float* row1 = heights + v1 * width;
+		float* out = &grid[(i + 1) * stride + 1];
+
+		for (int j = 0; j < n; j++)
+		{
+			float u = j * u_scale;
+			int u0 = std::min((int)u, width - 1), u1 = std::min(u0 + 1, width - 1);
+			float fu = u - u0;
+
+			float top = row0[u0] + (row0[u1] - row0[u0]) * fu;
+			float bottom = row1[u0] + (row1[u1] - row1[u0]) * fu;
+			out[j] = top + (bottom - top) * fv;
+		}
+
+		out[-1] = out[0];
+		out[n] = out[n - 1];
+	}
+	memcpy(&grid[0], &grid[stride], sizeof(float) * stride);
+	memcpy(&grid[(n + 1) * stride], &grid[n * stride], sizeof(float) * stride);
+
+	// Sobel gradients one row at a time. The inner loops are straight
+	// float arithmetic over contiguous rows, which the compiler vectorizes
+	const float step = size / n;
+	const float norm = 1.f / (8.f * step);
+	std::vector<float> gx(n), gz(n);
+
+	for (int i = 0; i < n; i++)
+	{
+		const float* up = &grid[i * stride + 1];
+		const float* mid = up + stride;
+		const float* down = mid + stride;
+
+		for (int j = 0; j < n; j++)
+		{
+			gx[j] = ((down[j - 1] + 2 * down[j] + down[j + 1]) - (up[j - 1] + 2 * up[j] + up[j + 1])) * norm;
+			gz[j] = ((up[j + 1] + 2 * mid[j + 1] + down[j + 1]) - (up[j - 1] + 2 * mid[j - 1] + down[j - 1])) * norm;
+		}
+
+		for (int j = 0; j < n; j++)
+		{
+			Vertex& vert = vertices[i * n + j];
+			float n_len = 1.f / sqrtf(gx[j] * gx[j] + 1 + gz[j] * gz[j]);
+			float t_len = 1.f / sqrtf(1 + gx[j] * gx[j]);
+
+			vert.position[1] = mid[j];
+
+			vert.normal[0] = -gx[j] * n_len;
+			vert.normal[1] = n_len;
+			vert.normal[2] = -gz[j] * n_len;
+
+			// texture u runs along x
+			vert.tangent[0] = t_len;
+			vert.tangent[1] = gx[j] * t_len;
+			vert.tangent[2] = 0;
+		}
+	}
+
+	compute_bounds();
+}
+
+//------------------------------------------------------------------------------
+Volume::Volume(Vec3 corner0, Vec3 corner1, int divisions)
+{
+	_corners[0] = corner0;
+	_corners[1] = corner1;
+	_divisions = divisions + 1;
+
+	// reserve space for the maximum number of tris that could be allocated
+	// int max_possible_tris = pow(8, divisions) * 5;
+	// int max_possible_verts = max_possible_tris * 3;
+	// vertices.reserve(max_possible_verts);
+}
+
+//------------------------------------------------------------------------------
+// Triangles of one slab of the grid, indexed from 0. top and bottom map the
+// y and z edges of the slab's outer x planes to the vertices made on them,
+// so neighbouring slabs can be welded when they're merged
+struct VolumeSlab {
+	std::vector<Vertex> vertices;
+	std::vector<uint32_t> indices;
+	std::vector<uint32_t> top, bottom;
+};
+
+//------------------------------------------------------------------------------
+// Bricks of voxels the surface may pass through. Everything outside of an
+// active brick is known to be entirely inside or outside
+struct VolumeBricks {
+	int size;  // voxels along a brick's edge
+	int count; // bricks along each axis
+	std::vector<uint8_t> active;
+
+	bool at(int x, int y, int z) const
+	{
+		return active[(x * count + y) * count + z];
+	}
+};
+
+//------------------------------------------------------------------------------
+// Top down pass over an octree of the voxel grid. With |grad density| <= L,
+// a node whose center density exceeds L times the distance to its farthest
+// sample (including the neighbours gradients read) can't contain a sign
+// change, so it and everything below it are skipped. Each level is sampled
+// in one batch
+static void volume_find_bricks(const Volume::DensityBatch& density_at,
+                               Vec3 p0,
+                               Vec3 voxel_delta,
+                               int divisions,
+                               float lipschitz,
+                               VolumeBricks* bricks)
+{
+	struct Node {
+		int x, y, z, size;
+	};
+
+	bricks->size = 8;
+	bricks->count = (divisions + bricks->size - 1) / bricks->size;
+	bricks->active.assign(bricks->count * bricks->count * bricks->count, 0);
+
+	int root = bricks->size;
+	while (root < divisions) root *= 2;
+
+	std::vector<Node> nodes = { { 0, 0, 0, root } }, next;
+	std::vector<float> soa;
+
+	while (!nodes.empty())
+	{
+		size_t batch = (nodes.size() + 7) & ~7;
+		soa.resize(batch * 4);
+		float *px = soa.data(), *py = px + batch, *pz = py + batch, *pd = pz + batch;
+
+		for (size_t i = 0; i < batch; ++i)
+		{
+			const Node& n = nodes[std::min(i, nodes.size() - 1)];
+			float h = n.size * 0.5f;
+			Vec3 p = p0 + voxel_delta * Vec3(n.x + h, n.y + h, n.z + h);
+			px[i] = p.x; py[i] = p.y; pz[i] = p.z;
+		}
+
+		density_at(px, py, pz, pd, batch);
+
+		next.clear();
+		for (size_t i = 0; i < nodes.size(); ++i)
+		{
+			const Node& n = nodes[i];
+			Vec3 half = voxel_delta * (n.size * 0.5f + 1);
+			float reach = lipschitz * sqrtf(half.x * half.x + half.y * half.y + half.z * half.z);
+
+			if (fabsf(pd[i]) > reach) continue;
+
+			if (n.size == bricks->size)
+			{
+				int b = bricks->count;
+				bricks->active[((n.x / bricks->size) * b + n.y / bricks->size) * b + n.z / bricks->size] = 1;
+				continue;
+			}
+
+			int s = n.size / 2;
+			for (int c = 8; c--;)
+			{
+				Node child = { n.x + (c & 1) * s, n.y + ((c >> 1) & 1) * s, n.z + ((c >> 2) & 1) * s, s };
+				if (child.x < divisions && child.y < divisions && child.z < divisions)
+				{
+					next.push_back(child);
+				}
+			}
+		}
+
+		nodes.swap(next);
+	}
+}
+
+//------------------------------------------------------------------------------
+// Density sampled once per lattice point, over a window of four x planes
+// (enough for a voxel's two planes plus central differences either side).
+// Each plane has a one point border outside the grid, so gradients at the
+// volume's faces don't need one sided differences
+struct DensityPlanes {
+	DensityPlanes(const Volume::DensityBatch& density_at, Vec3 p0, Vec3 voxel_delta, int divisions,
+	              const VolumeBricks* bricks) :
+		density_at(density_at), p0(p0), voxel_delta(voxel_delta),
+		side(divisions + 3), bricks(bricks)
+	{
+		for (int i = 4; i--;)
+		{
+			planes[i].resize(side * side);
+			plane_x[i] = -2; // below any plane that can be asked for
+		}
+
+		// x, y, z and density arrays for one plane, padded to a multiple
+		// of 8 and 32 byte aligned for the batch callable's benefit
+		batch = (side * side + 7) & ~7;
+		soa.resize(batch * 4 + 8);
+		soa_base = soa.data() + ((32 - ((uintptr_t)soa.data() & 31)) & 31) / sizeof(float);
+	}
+
+	// lattice point position, shared by sampling and vertex placement
+	Vec3 position(int x, int y, int z)
+	{
+		return p0 + voxel_delta * Vec3(x, y, z);
+	}
+
+	float at(int x, int y, int z)
+	{
+		return plane(x)[(y + 1) * side + (z + 1)];
+	}
+
+	void gradient(vec3 grad, int x, int y, int z)
+	{
+		grad[0] = at(x + 1, y, z) - at(x - 1, y, z);
+		grad[1] = at(x, y + 1, z) - at(x, y - 1, z);
+		grad[2] = at(x, y, z + 1) - at(x, y, z - 1);
+	}
+
+private:
+	const Volume::DensityBatch& density_at;
+	Vec3 p0, voxel_delta;
+	int side;
+	const VolumeBricks* bricks;
+	std::vector<uint8_t> needed;
+	size_t batch;
+	std::vector<float> planes[4];
+	int plane_x[4];
+	std::vector<float> soa;
+	float* soa_base;
+
+	float* plane(int x)
+	{
+		int slot = (x + 1) & 3;
+		std::vector<float>& d = planes[slot];
+
+		if (plane_x[slot] != x)
+		{
+			float *px = soa_base, *py = px + batch, *pz = py + batch, *pd = pz + batch;
+			size_t i = 0;
+
+			if (bricks) mark_needed(x);
+
+			for (int y = -1; y < side - 1; ++y)
+			for (int z = -1; z < side - 1; ++z)
+			{
+				if (bricks && !needed[(y + 1) * side + (z + 1)]) continue;
+
+				Vec3 p = position(x, y, z);
+				px[i] = p.x; py[i] = p.y; pz[i] = p.z;
+				++i;
+			}
+
+			if (i == 0) i = 1, px[0] = py[0] = pz[0] = 0;
+			size_t count = (i + 7) & ~7;
+
+			// padding repeats the last point
+			for (; i < count; ++i)
+			{
+				px[i] = px[i - 1]; py[i] = py[i - 1]; pz[i] = pz[i - 1];
+			}
+
+			density_at(px, py, pz, pd, count);
+
+			if (bricks)
+			{
+				i = 0;
+				for (size_t k = 0; k < d.size(); ++k)
+				{
+					if (needed[k]) d[k] = pd[i++];
+				}
+			}
+			else
+			{
+				memcpy(d.data(), pd, sizeof(float) * d.size());
+			}
+
+			plane_x[slot] = x;
+		}
+
+		return d.data();
+	}
+
+	// Samples on plane x that an active brick's voxels, or their gradients,
+	// will read: a brick spanning voxels [b, b + size) reads lattice points
+	// [b - 1, b + size + 1] along each axis
+	void mark_needed(int x)
+	{
+		int size = bricks->size;
+		needed.assign(side * side, 0);
+
+		for (int bx = std::max(0, (x - 1) / size - 1); bx < bricks->count && bx * size - 1 <= x; ++bx)
+		{
+			if (x > bx * size + size + 1) continue;
+
+			for (int by = 0; by < bricks->count; ++by)
+			for (int bz = 0; bz < bricks->count; ++bz)
+			{
+				if (!bricks->at(bx, by, bz)) continue;
+
+				int y1 = std::min(side - 2, by * size + size + 1);
+				int z1 = std::min(side - 2, bz * size + size + 1);
+				for (int y = by * size - 1; y <= y1; ++y)
+				{
+					memset(&needed[(y + 1) * side + bz * size], 1, z1 - (bz * size - 1) + 1);
+				}
+			}
+		}
+	}
+};
+
+//------------------------------------------------------------------------------
+static void volume_polygonize_slab(const Volume::DensityBatch& density_at,
+                                   Vec3 p0,
+                                   Vec3 voxel_delta,
+                                   int x_begin, int x_end, int divisions,
+                                   const VolumeBricks* bricks,
+                                   VolumeSlab* slab)
+{
+	#include "mc_luts.hpp"
+
+	std::vector<Vertex>& vertices = slab->vertices;
+	std::vector<uint32_t>& indices = slab->indices;
+	DensityPlanes density(density_at, p0, voxel_delta, divisions, bricks);
+	Vec3 extent = voxel_delta * (float)divisions;
+
+	const int c[8][3] = {
+		{ 0, 0, 0 },
+		{ 0, 1, 0 },
+		{ 1, 1, 0 },
+		{ 1, 0, 0 },
+
+		{ 0, 0, 1 },
+		{ 0, 1, 1 },
+		{ 1, 1, 1 },
+		{ 1, 0, 1 },
+	};
+
+	// Every lattice edge gets at most one vertex, shared by the four voxels
+	// around it. Edges are keyed by their lower end point and axis, in two
+	// rolling layers for the x planes the current voxel row spans
+	const int side = divisions + 1;
+	const uint32_t none = 0xFFFFFFFF;
+	std::vector<uint32_t> layers[2];
+	int layer_x[2] = { -1, -1 };
+
+	auto layer = [&](int px) -> uint32_t* {
+		std::vector<uint32_t>& l = layers[px & 1];
+		if (layer_x[px & 1] != px)
+		{
+			l.assign(side * side * 3, none);
+			layer_x[px & 1] = px;
+		}
+		return l.data();
+	};
+
+	slab->top.assign(side * side * 2, none);
+	slab->bottom.assign(side * side * 2, none);
+
+	// without bricks the whole yz plane is walked as one
+	const int brick_size = bricks ? bricks->size : divisions;
+	const int brick_count = bricks ? bricks->count : 1;
+
+	for (int x = x_end; x-- > x_begin;)
+	for (int by = brick_count; by--;)
+	for (int bz = brick_count; bz--;)
+	{
+		if (bricks && !bricks->at(x / brick_size, by, bz)) continue;
+
+		for (int y = std::min(divisions, (by + 1) * brick_size); y-- > by * brick_size;)
+		for (int z = std::min(divisions, (bz + 1) * brick_size); z-- > bz * brick_size;)
+		{
+			float d[8]; // densities at each corner
+			uint8_t voxel_case = 0;
+
+			// compute the case for voxel x,y,z
+			for (int i = 8; i--;)
+			{
+				d[i] = density.at(x + c[i][0], y + c[i][1], z + c[i][2]);
+
+				if (d[i] <= 0)
+				{
+					voxel_case |= (1 << i);
+				}
+			}
+
+			// up to 5 tris, each corner on one of the voxel's edges
+			for (int i = 0; i < 15; ++i)
+			{
+				int e_i = tri_edge_list_case[voxel_case][i];
+
+				if (e_i == -1) break;
+
+				const int* c0 = c[edge_list[e_i][0]];
+				const int* c1 = c[edge_list[e_i][1]];
+
+				int axis = c0[0] != c1[0] ? 0 : (c0[1] != c1[1] ? 1 : 2);
+				int ex = x + std::min(c0[0], c1[0]);
+				int ey = y + std::min(c0[1], c1[1]);
+				int ez = z + std::min(c0[2], c1[2]);
+				uint32_t& cached = layer(ex)[(ey * side + ez) * 3 + axis];
+
+				if (cached == none)
+				{
+					// v0 * w + v1 * (1 - w)
+					// w = 0.5
+					// -1 * w + 1 * (1 - w) = 0
+					//
+					// d0 * w + d1 * (1 - w) = 0
+					// d0 * w + d1 - d1 * w = 0
+					// (d0 * w - d1 * w) / w = -d1 / w
+					// d0 - d1 = -d1 / w
+					// -d1 / (d0 - d1) = w
+
+					// solve for the weight that will lerp between
+					float w = d[edge_list[e_i][0]] / (d[edge_list[e_i][0]] - d[edge_list[e_i][1]]);
+
+					Vertex v = {};
+					Vec3 _p = density.position(x + c1[0], y + c1[1], z + c1[2]) * w +
+					          density.position(x + c0[0], y + c0[1], z + c0[2]) * (1 - w);
+					vec3_copy(v.position, _p.v);
+
+					// the normal follows the density's gradient, taken by central
+					// differences at both lattice points and blended the same way
+					vec3 g0, g1, grad;
+					density.gradient(g0, x + c0[0], y + c0[1], z + c0[2]);
+					density.gradient(g1, x + c1[0], y + c1[1], z + c1[2]);
+					vec3_scale(g1, g1, w);
+					vec3_scale(g0, g0, 1 - w);
+					vec3_add(grad, g0, g1);
+					vec3_norm(v.normal, grad);
+
+					// UVs are the volume's bounds projected along the normal's
+					// dominant axis. The tangent is that projection's u axis,
+					// flattened onto the surface
+					int n_axis = 0;
+					for (int j = 1; j < 3; ++j)
+					{
+						if (fabsf(v.normal[j]) > fabsf(v.normal[n_axis])) n_axis = j;
+					}
+					int u_axis = (n_axis + 1) % 3, v_axis = (n_axis + 2) % 3;
+
+					v.texture[0] = extent.v[u_axis] != 0 ? (v.position[u_axis] - p0.v[u_axis]) / extent.v[u_axis] : 0;
+					v.texture[1] = extent.v[v_axis] != 0 ? (v.position[v_axis] - p0.v[v_axis]) / extent.v[v_axis] : 0;
+
+					vec3 u_dir = {};
+					u_dir[u_axis] = 1;
+					vec3_scale(grad, v.normal, vec3_mul_inner(v.normal, u_dir));
+					vec3_sub(u_dir, u_dir, grad);
+					vec3_norm(v.tangent, u_dir);
+
+					cached = vertices.size();
+					vertices.push_back(v);
+
+					if (axis != 0 && (ex == x_begin || ex == x_end))
+					{
+						std::vector<uint32_t>& outer = ex == x_end ? slab->top : slab->bottom;
+						outer[(ey * side + ez) * 2 + axis - 1] = cached;
+					}
+				}
+
+				indices.push_back(cached);
+			}
+		}
+	}
+}
+
+//------------------------------------------------------------------------------
+void Volume::generate(float(*density_at)(vec3 loc), int threads)
+{
+	generate([density_at](const float* x, const float* y, const float* z, float* density, size_t count) {
+		for (size_t i = 0; i < count; ++i)
+		{
+			vec3 p = { x[i], y[i], z[i] };
+			density[i] = density_at(p);
+		}
+	}, threads);
+}
+
+//------------------------------------------------------------------------------
+void Volume::generate(DensityBatch density_at, int threads)
+{
+	float div = _divisions;
+
+	Vec3& p0 = _corners[0];
+	Vec3& p1 = _corners[1];
+	Vec3 block_delta = (p1 - p0);
+	Vec3 voxel_delta = block_delta / div;
+
+	VolumeBricks bricks;
+	if (lipschitz > 0)
+	{
+		volume_find_bricks(density_at, p0, voxel_delta, _divisions, lipschitz, &bricks);
+	}
+
+	// The grid is cut into slabs along x. There are several per worker so
+	// that slabs through empty space don't leave threads idle while others
+	// are still crossing the surface. Slabs are claimed from a shared
+	// counter, but merged in grid order
+	int slab_count = std::max(1, std::min(_divisions, threads * 4));
+	std::vector<VolumeSlab> slabs(slab_count);
+	std::atomic<int> next_slab(0);
+
+	auto work = [&]() {
+		for (int s; (s = next_slab++) < slab_count;)
+		{
+			// slab 0 holds the highest x, matching the serial walk's order
+			int x_end = _divisions - (_divisions * s) / slab_count;
+			int x_begin = _divisions - (_divisions * (s + 1)) / slab_count;
+			volume_polygonize_slab(density_at, p0, voxel_delta, x_begin, x_end, _divisions,
+			                       lipschitz > 0 ? &bricks : nullptr, &slabs[s]);
+		}
+	};
+
+	if (threads <= 1)
+	{
+		work();
+	}
+	else
+	{
+		std::vector<std::thread> workers;
+		for (int i = std::min(threads, slab_count); i--;)
+		{
+			workers.push_back(std::thread(work));
+		}
+
+		for (auto& worker : workers)
+		{
+			worker.join();
+		}
+	}
+
+	size_t vert_total = vertices.size(), index_total = indices.size();
+	for (auto& slab : slabs)
+	{
+		vert_total += slab.vertices.size();
+		index_total += slab.indices.size();
+	}
+	vertices.reserve(vert_total);
+	indices.reserve(index_total);
+
+	// Vertices on the plane two slabs share were made by both. The lower
+	// slab's copies are replaced by the upper's, which leaves the same
+	// vertices, in the same order, as walking the grid in one slab would
+	std::vector<uint32_t> remap;
+	for (int s = 0; s < slab_count; ++s)
+	{
+		VolumeSlab& slab = slabs[s];
+		remap.assign(slab.vertices.size(), 0xFFFFFFFF);
+
+		if (s > 0)
+		{
+			std::vector<uint32_t>& above = slabs[s - 1].bottom;
+			for (size_t e = 0; e < slab.top.size(); ++e)
+			{
+				if (slab.top[e] != 0xFFFFFFFF && above[e] != 0xFFFFFFFF)
+				{
+					remap[slab.top[e]] = above[e];
+				}
+			}
+
+			slabs[s - 1] = VolumeSlab();
+		}
+
+		for (size_t i = 0; i < slab.vertices.size(); ++i)
+		{
+			if (remap[i] != 0xFFFFFFFF) continue;
+
+			remap[i] = vertices.size();
+			vertices.push_back(slab.vertices[i]);
+		}
+
+		for (auto i : slab.indices) indices.push_back(remap[i]);
+
+		// bottom is still needed by the next slab, in merged indices
+		for (auto& i : slab.bottom) if (i != 0xFFFFFFFF) i = remap[i];
+	}
+
+	compute_bounds();
+}
+//------------------------------------------------------------------------------
+ChunkedVolume::ChunkedVolume(Vec3 corner0, Vec3 corner1, int chunks, int chunk_divisions, Volume::DensityBatch density)
+{
+	_density = density;
+	_chunk_divisions = chunk_divisions;
+	_alive = std::make_shared<bool>(true);
+
+	// Volume(c0, c1, n) spans n + 1 voxels
+	Vec3 chunk_size = (corner1 - corner0) / (float)chunks;
+	_voxel_size = std::max(chunk_size.x, std::max(chunk_size.y, chunk_size.z)) / (chunk_divisions + 1);
+
+	for (int x = 0; x < chunks; ++x)
+	for (int y = 0; y < chunks; ++y)
+	for (int z = 0; z < chunks; ++z)
+	{
+		Chunk chunk = {};
+		Vec3 index(x, y, z);
+		chunk.corners[0] = corner0 + chunk_size * index;
+		chunk.corners[1] = chunk.corners[0] + chunk_size;
+		chunk.dirty = true;
+
+		_chunks.push_back(chunk);
+	}
+}
+
+//------------------------------------------------------------------------------
+ChunkedVolume::~ChunkedVolume()
+{
+	_alive.reset();
+
+	for (auto& chunk : _chunks)
+	{
+		delete chunk.model;
+	}
+}
+
+//------------------------------------------------------------------------------
+void ChunkedVolume::add_sphere(Vec3 center, float radius)
+{
+	edit({ center, radius, true });
+}
+
+//------------------------------------------------------------------------------
+void ChunkedVolume::subtract_sphere(Vec3 center, float radius)
+{
+	edit({ center, radius, false });
+}
+
+//------------------------------------------------------------------------------
+bool ChunkedVolume::reaches(const Edit& edit, const Chunk& chunk)
+{
+	// An edit changes densities out to a voxel beyond its surface, and a
+	// brick samples a voxel past its bounds for gradients. Padding by a
+	// little more than both keeps neighbouring bricks agreeing on every
+	// sample they share
+	float reach = edit.radius + _voxel_size * 3;
+	float dist2 = 0;
+
+	for (int i = 3; i--;)
+	{
+		float c = edit.center.v[i];
+		float d = std::max(chunk.corners[0].v[i] - c, std::max(0.f, c - chunk.corners[1].v[i]));
+		dist2 += d * d;
+	}
+
+	return dist2 <= reach * reach;
+}
+
+//------------------------------------------------------------------------------
+void ChunkedVolume::edit(Edit edit)
+{
+	for (auto& chunk : _chunks)
+	{
+		if (!reaches(edit, chunk)) continue;
+
+		chunk.edits.push_back(edit);
+		chunk.dirty = true;
+	}
+}
+
+//------------------------------------------------------------------------------
+void ChunkedVolume::remesh(int index)
+{
+	Chunk& chunk = _chunks[index];
+	chunk.dirty = false;
+	chunk.meshing = true;
+
+	// the worker gets its own copy of everything it reads
+	std::vector<Edit> edits = chunk.edits;
+	std::shared_ptr<const std::vector<float>> baked = chunk.field;
+	Volume::DensityBatch base = _density;
+	float influence = _voxel_size;
+	Vec3 corner0 = chunk.corners[0], corner1 = chunk.corners[1];
+	int divisions = _chunk_divisions;
+	std::weak_ptr<bool> alive = _alive;
+
+	Loader.enqueue([=]() {
+		// the lattice Volume samples, a point past the brick on each side.
+		// Volume(c0, c1, n) spans n + 1 voxels
+		const int side = divisions + 4;
+		const Vec3 voxel_delta = (corner1 - corner0) / (float)(divisions + 1);
+		auto field = std::make_shared<std::vector<float>>(side * side * side);
+
+		if (baked)
+		{
+			*field = *baked;
+		}
+		else
+		{
+			// one x plane per call, aligned and padded as DensityBatch
+			// promises
+			size_t batch = (side * side + 7) & ~7;
+			std::vector<float> soa(batch * 4 + 8);
+			float* px = soa.data() + ((32 - ((uintptr_t)soa.data() & 31)) & 31) / sizeof(float);
+			float *py = px + batch, *pz = py + batch, *pd = pz + batch;
+
+			for (int x = 0; x < side; ++x)
+			{
+				size_t i = 0;
+				for (int y = 0; y < side; ++y)
+				for (int z = 0; z < side; ++z, ++i)
+				{
+					Vec3 p = corner0 + voxel_delta * Vec3(x - 1, y - 1, z - 1);
+					px[i] = p.x; py[i] = p.y; pz[i] = p.z;
+				}
+
+				for (; i < batch; ++i)
+				{
+					px[i] = px[i - 1]; py[i] = py[i - 1]; pz[i] = pz[i - 1];
+				}
+
+				base(px, py, pz, pd, batch);
+				memcpy(field->data() + x * side * side, pd, side * side * sizeof(float));
+			}
+		}
+
+		// CSG against the spheres, each confined to a voxel past its
+		// surface. Beyond that it could only change a sample's magnitude,
+		// never its sign, which is what lets edits stay local
+		for (auto& edit : edits)
+		for (int x = 0; x < side; ++x)
+		for (int y = 0; y < side; ++y)
+		for (int z = 0; z < side; ++z)
+		{
+			Vec3 p = corner0 + voxel_delta * Vec3(x - 1, y - 1, z - 1);
+			vec3 delta = { p.x - edit.center.x, p.y - edit.center.y, p.z - edit.center.z };
+			float dist = vec3_len(delta);
+
+			if (dist >= edit.radius + influence) continue;
+
+			float& d = (*field)[(x * side + y) * side + z];
+			d = edit.add ? std::min(d, dist - edit.radius) : std::max(d, edit.radius - dist);
+		}
+
+		// Volume only ever asks for lattice points, which are looked up
+		const std::vector<float>& f = *field;
+		auto lookup = [&](const float* x, const float* y, const float* z, float* d, size_t count) {
+			for (size_t i = 0; i < count; ++i)
+			{
+				int l[3] = {
+					(int)lroundf((x[i] - corner0.x) / voxel_delta.x) + 1,
+					(int)lroundf((y[i] - corner0.y) / voxel_delta.y) + 1,
+					(int)lroundf((z[i] - corner0.z) / voxel_delta.z) + 1,
+				};
+
+				for (int j = 3; j--;) l[j] = std::min(std::max(l[j], 0), side - 1);
+
+				d[i] = f[(l[0] * side + l[1]) * side + l[2]];
+			}
+		};
+
+		Volume* volume = new Volume(corner0, corner1, divisions);
+		volume->generate(lookup);
+
+		size_t bytes = volume->vert_count() * sizeof(Vertex) + volume->index_count() * sizeof(uint32_t);
+		size_t edit_count = edits.size();
+		Loader.upload(bytes, [=]() {
+			if (alive.lock())
+			{
+				Chunk& chunk = _chunks[index];
+
+				if (chunk.model)
+				{
+					chunk.model->upload(volume);
+				}
+				else
+				{
+					chunk.model = new Model(volume);
+				}
+
+				// edits made while this was meshing stay queued
+				chunk.field = field;
+				chunk.edits.erase(chunk.edits.begin(), chunk.edits.begin() + edit_count);
+				chunk.meshing = false;
+			}
+
+			delete volume;
+		});
+	});
+}
+
+//------------------------------------------------------------------------------
+void ChunkedVolume::draw()
+{
+	for (int i = 0; i < (int)_chunks.size(); ++i)
+	{
+		// a brick edited while meshing is picked up once it lands
+		if (_chunks[i].dirty && !_chunks[i].meshing)
+		{
+			remesh(i);
+		}
+	}
+
+	for (auto& chunk : _chunks)
+	{
+		if (chunk.model) chunk.model->draw();
+	}
+}
+
+//------------------------------------------------------------------------------
+int ChunkedVolume::pending_chunks()
+{
+	int pending = 0;
+
+	for (auto& chunk : _chunks)
+	{
+		pending += chunk.dirty || chunk.meshing;
+	}
+
+	return pending;
+}
+
+//------------------------------------------------------------------------------
+// unit grid in xz, from 0 to 1, quads along each side
+struct TerrainPatch : Mesh
+{
+	TerrainPatch(int quads)
+	{
+		int n = quads + 1;
+
+		for (int i = 0; i < n; i++)
+		for (int j = 0; j < n; j++)
+		{
+			float x = i / (float)quads, z = j / (float)quads;
+			Vertex v = {
+				.position = { x, 0, z },
+				.normal = { 0, 1, 0 },
+				.tangent = { 1, 0, 0 },
+				.texture = { x, z, 0 }
+			};
+
+			vertices.push_back(v);
+		}
+
+		for (int y = 0; y < quads; y++)
+		for (int x = 0; x < quads; x++)
+		{
+			int i = x + y * n;
+			int j = x + (y + 1) * n;
+			indices.push_back(i);
+			indices.push_back(i + 1);
+			indices.push_back(j);
+
+			indices.push_back(j + 1);
+			indices.push_back(j);
+			indices.push_back(i + 1);
+		}
+	}
+};
+
+//------------------------------------------------------------------------------
+Terrain::Terrain(std::string path, float size, float height, int levels, int patch_resolution)
+{
+	void* data = nullptr;
+	int depth, bits;
+
+	assert(levels > 0 && patch_resolution % 4 == 0);
+
+	_heights = 0;
+	_patch = nullptr;
+	_size = size;
+	_scale = height;
+	_levels = levels;
+	_patch_resolution = patch_resolution;
+	lod_distance = 2 * size / (1 << (levels - 1));
+
+	if (TextureFactory::load_texture_buffer(path, &data, _width, _height, depth, &bits))
+	{
+		return;
+	}
+
+	// keep only the first channel, at the image's own precision
+	int texels = _width * _height;
+	for (int i = 0; i < texels; i++)
+	{
+		if (bits == 16)
+		{
+			((uint16_t*)data)[i] = ((uint16_t*)data)[i * depth];
+		}
+		else
+		{
+			((uint8_t*)data)[i] = ((uint8_t*)data)[i * depth];
+		}
+	}
+
+	auto texel = [&](int col, int row) -> float {
+		int i = col + row * _width;
+		return bits == 16 ? ((uint16_t*)data)[i] / 65535.f : ((uint8_t*)data)[i] / 255.f;
+	};
+
+	// leaf bounds straight from the texels, including the edges they share
+	// with their neighbours, then each parent from its children
+	_bounds.resize(levels);
+	for (int d = levels; d--;)
+	{
+		int n = 1 << d;
+		auto& bounds = _bounds[d];
+		bounds.resize(n * n * 2);
+
+		for (int z = 0; z < n; z++)
+		for (int x = 0; x < n; x++)
+		{
+			float lo = 1, hi = 0;
+
+			if (d == levels - 1)
+			{
+				int c0 = x * (_width - 1) / n, c1 = ((x + 1) * (_width - 1) + n - 1) / n;
+				int r0 = z * (_height - 1) / n, r1 = ((z + 1) * (_height - 1) + n - 1) / n;
+
+				for (int r = r0; r <= r1; r++)
+				for (int c = c0; c <= c1; c++)
+				{
+					float h = texel(c, r);
+					lo = std::min(lo, h);
+					hi = std::max(hi, h);
+				}
+			}
+			else
+			{
+				auto& children = _bounds[d + 1];
+				for (int cz = 0; cz < 2; cz++)
+				for (int cx = 0; cx < 2; cx++)
+				{
+					int child = (2 * z + cz) * n * 2 + 2 * x + cx;
+					lo = std::min(lo, children[child * 2]);
+					hi = std::max(hi, children[child * 2 + 1]);
+				}
+			}
+
+			bounds[(z * n + x) * 2] = lo;
+			bounds[(z * n + x) * 2 + 1] = hi;
+		}
+	}
+
+	glGenTextures(1, &_heights);
+	glBindTexture(GL_TEXTURE_2D, _heights);
+	glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+	glTexImage2D(
+		GL_TEXTURE_2D,
+		0,
+		bits == 16 ? GL_R16 : GL_R8,
+		_width, _height,
+		0,
+		GL_RED,
+		bits == 16 ? GL_UNSIGNED_SHORT : GL_UNSIGNED_BYTE,
+		data
+	);
+	glPixelStorei(GL_UNPACK_ALIGNMENT, 4);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+	free(data);
+
+	assert(gl_get_error());
+
+	// nodes are drawn a quadrant at a time, so one patch covers a quarter
+	TerrainPatch patch(patch_resolution / 2);
+	_patch = new Model(&patch);
+}
+
+//------------------------------------------------------------------------------
+Terrain::~Terrain()
+{
+	delete _patch;
+	glDeleteTextures(1, &_heights);
+}
+
+//------------------------------------------------------------------------------
+bool Terrain::in_range(int depth, int x, int z, Vec3 eye, float range)
+{
+	float node_size = _size / (1 << depth);
+	int n = 1 << depth;
+	const float* bounds = &_bounds[depth][(z * n + x) * 2];
+
+	Vec3 lo(-_size / 2 + x * node_size, bounds[0] * _scale, -_size / 2 + z * node_size);
+	Vec3 hi(lo.x + node_size, bounds[1] * _scale, lo.z + node_size);
+
+	// squared distance from the eye to the node's box
+	float dist = 0;
+	for (int i = 3; i--;)
+	{
+		float d = std::max(std::max(lo.v[i] - eye.v[i], eye.v[i] - hi.v[i]), 0.f);
+		dist += d * d;
+	}
+
+	return dist <= range * range;
+}
+
+//------------------------------------------------------------------------------
+void Terrain::add_quadrant(int depth, int x, int z, int lod)
+{
+	float node_size = _size / (1 << depth);
+
+	_selection.push_back({
+		-_size / 2 + x * node_size,
+		-_size / 2 + z * node_size,
+		node_size,
+		lod
+	});
+}
+
+//------------------------------------------------------------------------------
+bool Terrain::select(int depth, int x, int z, Vec3 eye)
+{
+	int lod = _levels - 1 - depth;
+
+	if (!in_range(depth, x, z, eye, _ranges[lod]))
+	{
+		return false;
+	}
+
+	// wholly beyond the finer level's reach, draw the node at this one
+	if (lod == 0 || !in_range(depth, x, z, eye, _ranges[lod - 1]))
+	{
+		for (int q = 0; q < 4; q++)
+		{
+			add_quadrant(depth + 1, 2 * x + (q & 1), 2 * z + (q >> 1), lod);
+		}
+
+		return true;
+	}
+
+	// children out of range leave their quadrant to this level
+	for (int q = 0; q < 4; q++)
+	{
+		int cx = 2 * x + (q & 1), cz = 2 * z + (q >> 1);
+
+		if (!select(depth + 1, cx, cz, eye))
+		{
+			add_quadrant(depth + 1, cx, cz, lod);
+		}
+	}
+
+	return true;
+}
+
+//------------------------------------------------------------------------------
+void Terrain::draw()
+{
+	if (!_patch) return;
+
+	Vec3 eye(0, 0, 0);
+	if (Viewer::active)
+	{
+		eye = Viewer::active->position();
+	}
+
+	_ranges.resize(_levels);
+	for (int i = 0; i < _levels; i++)
+	{
+		_ranges[i] = lod_distance * (1 << i);
+	}
+
+	_selection.clear();
+	if (!select(0, 0, 0, eye))
+	{
+		// past the coarsest range the root is still drawn, fully morphed
+		for (int q = 0; q < 4; q++)
+		{
+			add_quadrant(1, q & 1, q >> 1, _levels - 1);
+		}
+	}
+
+	static const Uniform u_height_sampler("u_height_sampler");
+	static const Uniform u_terrain("u_terrain");
+	static const Uniform u_view_position("u_view_position");
+	static const Uniform u_terrain_node("u_terrain_node");
+	static const Uniform u_terrain_morph("u_terrain_morph");
+
+	ShaderProgram& shader = *ShaderProgram::active();
+	vec4_t terrain = {{ _size, _scale, (float)_width, (float)_height }};
+
+	shader[u_height_sampler] << _heights;
+	shader[u_terrain] << terrain;
+	shader[u_view_position] << eye;
+
+	for (auto& node : _selection)
+	{
+		float prev = node.lod ? _ranges[node.lod - 1] : 0;
+		float end = _ranges[node.lod];
+
+		shader[u_terrain_node] << Vec3(node.x, node.z, node.size);
+		shader[u_terrain_morph] << Vec3(prev + (end - prev) * 0.7f, end, _patch_resolution / 2);
+		_patch->draw();
+	}
+}
+
+//------------------------------------------------------------------------------
+int Terrain::selected_patches()
+{
+	return _selection.size();
+}
+
+//------------------------------------------------------------------------------
+//     ___  ___    _
+//    / _ \| _ )_ | |
+//   | (_) | _ \ || |
+//    \___/|___/\__/
+//
+struct ObjFace {
+	int pos_idx[3], tex_idx[3], norm_idx[3];
+};
+
+//------------------------------------------------------------------------------
+static const char* obj_parse_face(const char* c, const char* end, ObjFace& face)
+{
+	bzero(&face, sizeof(face));
+
+	for(int i = 0; i < 3; ++i)
+	{
+		c = txt_skip_space(c, end);
+		if(c >= end) break;
+
+		// v, v/vt, v//vn or v/vt/vn
+		c = txt_parse_int(c, end, face.pos_idx[i]);
+		if(c < end && *c == '/')
+		{
+			c = txt_parse_int(c + 1, end, face.tex_idx[i]);
+			if(c < end && *c == '/')
+			{
+				c = txt_parse_int(c + 1, end, face.norm_idx[i]);
+			}
+		}
+
+		c = txt_skip_token(c, end);
+	}
+
+	return c;
+}
+
+//------------------------------------------------------------------------------
+struct ObjChunk {
+	std::vector<vec3_t> positions, tex_coords, normals, params;
+	std::vector<ObjFace> faces;
+};
+
+//------------------------------------------------------------------------------
+static void obj_parse_chunk(const char* c, const char* end, ObjChunk* chunk)
+{
+	while(c < end)
+	{
+		const char* eol = (const char*)memchr(c, '\n', end - c);
+		if(!eol) eol = end;
+
+		c = txt_skip_space(c, eol);
+		const char* tag = c;
+		c = txt_skip_token(c, eol);
+
+		switch(c - tag)
+		{
+			case 1:
+				if(tag[0] == 'v')
+				{
+					vec3_t p = {};
+					txt_parse_vec(c, eol, p.v, 3);
+					chunk->positions.push_back(p);
+				}
+				else if(tag[0] == 'f')
+				{
+					ObjFace f;
+					obj_parse_face(c, eol, f);
+					chunk->faces.push_back(f);
+				}
+				break;
+			case 2:
+				if(tag[0] != 'v') break;
+				if(tag[1] == 't')
+				{
+					vec3_t t = {};
+					txt_parse_vec(c, eol, t.v, 2);
+					chunk->tex_coords.push_back(t);
+				}
+				else if(tag[1] == 'n')
+				{
+					vec3_t n = {};
+					txt_parse_vec(c, eol, n.v, 3);
+					chunk->normals.push_back(n);
+				}
+				else if(tag[1] == 'p')
+				{
+					vec3_t p = {};
+					txt_parse_vec(c, eol, p.v, 3);
+					chunk->params.push_back(p);
+				}
+				break;
+			default:
+				// comments, groups, materials and blank lines are skipped
+				break;
+		}
+
+		c = eol + 1;
+	}
+}
+
+//------------------------------------------------------------------------------
+OBJMesh::OBJMesh(int fd, int threads)
+{
+	struct stat st;
+	if(fstat(fd, &st) || st.st_size == 0)
+	{
+		return;
+	}
+
+	// map the whole file, and walk it in place. No per-line syscalls
+	// or intermediate copies of the text are made
+	size_t size = st.st_size;
+	void* map = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+	if(map == MAP_FAILED)
+	{
+		fprintf(stderr, "Failed to mmap obj file, fd %d\n", fd);
+		return;
+	}
+	madvise(map, size, MADV_SEQUENTIAL);
+
+	const char* start = (const char*)map;
+	const char* end = start + size;
+
+	// don't bother spinning up workers for chunks smaller than this
+	const size_t min_chunk_size = 1 << 20;
+	size_t chunk_count = std::max<size_t>(1, std::min<size_t>(threads, size / min_chunk_size));
+	std::vector<ObjChunk> chunks(chunk_count);
+
+	if(chunk_count == 1)
+	{
+		obj_parse_chunk(start, end, &chunks[0]);
+	}
+	else
+	{
+		// split the file into roughly equal ranges, moving each boundary
+		// forward to just past the next newline so no line is cut in two
+		std::vector<const char*> bounds(chunk_count + 1, end);
+		bounds[0] = start;
+		for(size_t i = 1; i < chunk_count; ++i)
+		{
+			const char* b = std::max(bounds[i - 1], start + (size * i) / chunk_count);
+			const char* eol = (const char*)memchr(b, '\n', end - b);
+			bounds[i] = eol ? eol + 1 : end;
+		}
+
+		std::vector<std::thread> workers;
+		for(size_t i = 0; i < chunk_count; ++i)
+		{
+			workers.push_back(std::thread(obj_parse_chunk, bounds[i], bounds[i + 1], &chunks[i]));
+		}
+
+		for(auto& worker : workers) worker.join();
+	}
+
+	munmap(map, size);
+
+	// merge chunks in file order, so the result is identical to a serial parse
+	std::vector<ObjFace> faces;
+	for(auto& chunk : chunks)
+	{
+		positions.insert(positions.end(), chunk.positions.begin(), chunk.positions.end());
+		tex_coords.insert(tex_coords.end(), chunk.tex_coords.begin(), chunk.tex_coords.end());
+		normals.insert(normals.end(), chunk.normals.begin(), chunk.normals.end());
+		params.insert(params.end(), chunk.params.begin(), chunk.params.end());
+		faces.insert(faces.end(), chunk.faces.begin(), chunk.faces.end());
+		chunk = ObjChunk();
+	}
+
+	// each unique pos/tex/norm triple becomes one vertex
+	VertexTable index_map(positions.size());
+	indices.reserve(faces.size() * 3);
+
+	for(auto& f : faces)
+	{
+		for(int i = 0; i < 3; ++i)
+		{
+			uint32_t key[3] = {
+				(uint32_t)f.pos_idx[i], (uint32_t)f.tex_idx[i], (uint32_t)f.norm_idx[i]
+			};
+			uint32_t index = index_map.find_or_insert(key, vertices.size());
+
+			if(index == vertices.size())
+			{
+				Vertex v = {};
+				int pi = f.pos_idx[i], ti = f.tex_idx[i], ni = f.norm_idx[i];
+				if(pi > 0 && pi <= (int)positions.size())  vec3_copy(v.position, positions[pi - 1].v);
+				if(ti > 0 && ti <= (int)tex_coords.size()) vec3_copy(v.texture,  tex_coords[ti - 1].v);
+				if(ni > 0 && ni <= (int)normals.size())    vec3_copy(v.normal,   normals[ni - 1].v);
+				vertices.push_back(v);
+			}
+
+			indices.push_back(index);
+		}
+	}
+
+	// files without vn lines get smooth normals of their own
+	if(normals.empty())
+	{
+		compute_normals(threads);
+	}
+
+	compute_tangents(threads);
+	compute_bounds();
+}
+
+//------------------------------------------------------------------------------
+OBJMesh::~OBJMesh()
+{
+
+}
+
+//------------------------------------------------------------------------------
+//    ___       _          _
+//   | _ ) __ _| |_____ __| |
+//   | _ \/ _` | / / -_) _` |
+//   |___/\__,_|_\_\___\__,_|
+//
+BakedMesh::BakedMesh(void* map, size_t size)
+{
+	_map = map;
+	_size = size;
+	_header = (BakedMeshHeader*)map;
+
+	_bounds.min = Vec3(_header->min[0], _header->min[1], _header->min[2]);
+	_bounds.max = Vec3(_header->max[0], _header->max[1], _header->max[2]);
+	_bounds.center = Vec3(_header->center[0], _header->center[1], _header->center[2]);
+	_bounds.radius = _header->radius;
+	_has_bounds = true;
+
+	// the LOD chain follows the indices, its sizes first, each level as
+	// 32 bit indices. It's copied out as Models upload it from vectors
+	size_t index_size = index_type() == GL_UNSIGNED_SHORT ? sizeof(uint16_t) : sizeof(uint32_t);
+	const uint8_t* lods = (const uint8_t*)(verts() + vert_count()) + index_count() * index_size;
+	const uint8_t* level = lods + _header->lod_count * sizeof(uint32_t);
+
+	for(uint32_t i = 0; i < _header->lod_count; ++i)
+	{
+		uint32_t count;
+		memcpy(&count, lods + i * sizeof(uint32_t), sizeof(count));
+
+		lod_indices.push_back(std::vector<uint32_t>(count));
+		memcpy(lod_indices.back().data(), level, count * sizeof(uint32_t));
+		level += count * sizeof(uint32_t);
+	}
+}
+
+//------------------------------------------------------------------------------
+BakedMesh::~BakedMesh()
+{
+	munmap(_map, _size);
+}
+
+//------------------------------------------------------------------------------
+unsigned int BakedMesh::vert_count()
+{
+	return _header->vert_count;
+}
+
+//------------------------------------------------------------------------------
+unsigned int BakedMesh::index_count()
+{
+	return _header->index_count;
 }
 
 //------------------------------------------------------------------------------
-OBJMesh::~OBJMesh()
+Vertex* BakedMesh::verts()
+{
+	// the vertex array immediately follows the header
+	return (Vertex*)(_header + 1);
+}
+
+//------------------------------------------------------------------------------
+GLenum BakedMesh::index_type()
 {
+	return _header->index_type;
+}
 
+//------------------------------------------------------------------------------
+const void* BakedMesh::index_buffer(std::vector<uint16_t>& scratch)
+{
+	// indices are stored already narrowed, right after the vertices
+	return verts() + _header->vert_count;
 }
 
 //------------------------------------------------------------------------------
@@ -700,9 +2971,23 @@ OBJMesh::~OBJMesh()
 //   | _/ _` / _|  _/ _ \ '_| || |
 //   |_|\__,_\__|\__\___/_|  \_, |
 //                           |__/
-Mesh* MeshFactory::get_mesh(std::string path)
+bool MeshFactory::use_baked = true;
+int MeshFactory::lod_levels = 1;
+//------------------------------------------------------------------------------
+
+Mesh* MeshFactory::get_mesh(std::string path, int threads)
 {
 	static std::map<std::string, Mesh*> _cached_models;
+	static std::mutex cache_mutex;
+
+	{
+		// meshes may be loaded from Loader's worker threads
+		std::unique_lock<std::mutex> lock(cache_mutex);
+		if(_cached_models.count(path))
+		{
+			return _cached_models[path];
+		}
+	}
 
 	// try to open this file
 	std::string full_path = DATA_PATH + "/" + path;
@@ -724,6 +3009,7 @@ Mesh* MeshFactory::get_mesh(std::string path)
 	if(ext == nullptr)
 	{
 		fprintf(stderr, "Failed find to path's extension '%s'\n", full_path.c_str());
+		close(fd);
 		return nullptr;
 	}
 
@@ -738,24 +3024,193 @@ Mesh* MeshFactory::get_mesh(std::string path)
 		}
 	}
 
-	if(_cached_models.count(path) == 0)
+	struct stat source;
+	fstat(fd, &source);
+
+	std::string baked_path = full_path + ".baked";
+	Mesh* mesh = use_baked ? load_baked(baked_path, source) : nullptr;
+
+	if(mesh == nullptr)
 	{
 		switch (matched_ext)
 		{
 			case 0:
-				_cached_models[path] = new STLMesh(fd);
+				mesh = new STLMesh(fd);
 				break;
 			case 1:
-				_cached_models[path] = new OBJMesh(fd);
+				mesh = new OBJMesh(fd, threads);
 				break;
 			default:
 				fprintf(stderr, "No loader matched\n");
 		}
+
+		// simplified before baking, so loads from the blob skip it
+		if(mesh && lod_levels > 1)
+		{
+			mesh->generate_lods(lod_levels);
+		}
+
+		if(mesh && use_baked)
+		{
+			bake(mesh, baked_path, source);
+		}
 	}
 
-	assert(_cached_models[path]);
+	close(fd);
 
-	return _cached_models[path];
+	assert(mesh);
+
+	std::unique_lock<std::mutex> lock(cache_mutex);
+	if(_cached_models.count(path))
+	{
+		// another thread finished loading the same path first
+		delete mesh;
+		return _cached_models[path];
+	}
+	_cached_models[path] = mesh;
+
+	return mesh;
+}
+//------------------------------------------------------------------------------
+
+Mesh* MeshFactory::load_baked(std::string path, struct stat& source)
+{
+	int fd = open(path.c_str(), O_RDONLY);
+	if(fd < 0)
+	{
+		return nullptr;
+	}
+
+	struct stat st;
+	size_t size = 0;
+	void* map = MAP_FAILED;
+
+	if(fstat(fd, &st) == 0 && st.st_size >= (off_t)sizeof(BakedMeshHeader))
+	{
+		size = st.st_size;
+		map = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+	}
+
+	if(map != MAP_FAILED)
+	{
+		// start reading the blob in now, rather than faulting it in
+		// page by page during the upload
+		madvise(map, size, MADV_WILLNEED);
+	}
+	close(fd);
+
+	if(map == MAP_FAILED)
+	{
+		return nullptr;
+	}
+
+	// reject blobs from another version, build, LOD setting or source file
+	BakedMeshHeader* hdr = (BakedMeshHeader*)map;
+	size_t index_size = hdr->index_type == GL_UNSIGNED_SHORT ? sizeof(uint16_t) : sizeof(uint32_t);
+	size_t expected_size = sizeof(BakedMeshHeader) +
+	                       (size_t)hdr->vert_count * sizeof(Vertex) +
+	                       (size_t)hdr->index_count * index_size;
+	size_t lod_sizes = expected_size;
+
+	expected_size += (size_t)hdr->lod_count * sizeof(uint32_t);
+	for(uint32_t i = 0; i < hdr->lod_count && expected_size <= size; ++i)
+	{
+		uint32_t count;
+		memcpy(&count, (uint8_t*)map + lod_sizes + i * sizeof(uint32_t), sizeof(count));
+		expected_size += (size_t)count * sizeof(uint32_t);
+	}
+
+	if(memcmp(hdr->magic, "SEEN", 4) != 0 ||
+	   hdr->version != BakedMesh::version ||
+	   hdr->vertex_size != sizeof(Vertex) ||
+	   hdr->source_mtime != (int64_t)source.st_mtime ||
+	   hdr->source_size != (uint64_t)source.st_size ||
+	   hdr->lod_levels != (uint32_t)std::max(lod_levels, 1) ||
+	   expected_size != size)
+	{
+		munmap(map, size);
+		return nullptr;
+	}
+
+	return new BakedMesh(map, size);
+}
+//------------------------------------------------------------------------------
+
+bool MeshFactory::bake(Mesh* mesh, std::string path, struct stat& source)
+{
+	Vertex* v = mesh->verts();
+	if(v == nullptr || mesh->vert_count() == 0)
+	{
+		return false;
+	}
+
+	BakedMeshHeader hdr = {};
+	memcpy(hdr.magic, "SEEN", 4);
+	hdr.version = BakedMesh::version;
+	hdr.vertex_size = sizeof(Vertex);
+	hdr.index_type = mesh->index_type();
+	hdr.vert_count = mesh->vert_count();
+	hdr.index_count = mesh->index_count();
+	hdr.source_mtime = source.st_mtime;
+	hdr.source_size = source.st_size;
+
+	const Bounds& bounds = mesh->bounds();
+	vec3_copy(hdr.min, bounds.min.v);
+	vec3_copy(hdr.max, bounds.max.v);
+	vec3_copy(hdr.center, bounds.center.v);
+	hdr.radius = bounds.radius;
+	hdr.lod_levels = std::max(lod_levels, 1);
+	hdr.lod_count = mesh->lod_count() - 1;
+
+	std::vector<uint16_t> scratch;
+	size_t index_size = hdr.index_type == GL_UNSIGNED_SHORT ? sizeof(uint16_t) : sizeof(uint32_t);
+	const void* inds = mesh->index_buffer(scratch);
+
+	// write next to the destination then rename, so a reader never
+	// maps a partially written blob. The name is unique, as the same
+	// path may be loaded, and baked, by more than one thread at once
+	std::string tmp_path = path + ".XXXXXX";
+	int fd = mkstemp(&tmp_path[0]);
+	FILE* fp = fd < 0 ? nullptr : fdopen(fd, "wb");
+	if(!fp)
+	{
+		if(fd >= 0)
+		{
+			close(fd);
+			unlink(tmp_path.c_str());
+		}
+
+		fprintf(stderr, SEEN_TERM_YELLOW "Couldn't bake '%s'\n" SEEN_TERM_COLOR_OFF, path.c_str());
+		return false;
+	}
+
+	// mkstemp creates it private to the user, bake as fopen would have
+	fchmod(fd, 0644);
+
+	bool ok = fwrite(&hdr, sizeof(hdr), 1, fp) == 1 &&
+	          fwrite(v, sizeof(Vertex), hdr.vert_count, fp) == hdr.vert_count &&
+	          fwrite(inds, index_size, hdr.index_count, fp) == hdr.index_count;
+
+	for(uint32_t i = 1; ok && i <= hdr.lod_count; ++i)
+	{
+		uint32_t count = mesh->lod_inds(i).size();
+		ok = fwrite(&count, sizeof(count), 1, fp) == 1;
+	}
+
+	for(uint32_t i = 1; ok && i <= hdr.lod_count; ++i)
+	{
+		std::vector<uint32_t>& level = mesh->lod_inds(i);
+		ok = fwrite(level.data(), sizeof(uint32_t), level.size(), fp) == level.size();
+	}
+	ok = fclose(fp) == 0 && ok;
+
+	if(!ok || rename(tmp_path.c_str(), path.c_str()))
+	{
+		unlink(tmp_path.c_str());
+		return false;
+	}
+
+	return true;
 }
 //------------------------------------------------------------------------------
 
@@ -774,79 +3229,386 @@ Model* MeshFactory::get_model(std::string path)
 }
 //------------------------------------------------------------------------------
 
-Model::Model(Mesh* mesh)
+std::shared_future<Model*> MeshFactory::get_model_async(std::string path)
+{
+	static std::map<std::string, std::shared_future<Model*>> _cached_models;
+
+	if(_cached_models.count(path) == 0)
+	{
+		auto promise = std::make_shared<std::promise<Model*>>();
+		_cached_models[path] = promise->get_future().share();
+
+		Loader.enqueue([=]() {
+			Mesh* mesh = MeshFactory::get_mesh(path);
+
+			if(mesh == nullptr)
+			{
+				promise->set_value(nullptr);
+				return;
+			}
+
+			size_t index_size = mesh->index_type() == GL_UNSIGNED_SHORT ? sizeof(uint16_t) : sizeof(uint32_t);
+			size_t bytes = mesh->vert_count() * sizeof(Vertex) + mesh->index_count() * index_size;
+
+			Loader.upload(bytes, [=]() {
+				promise->set_value(new Model(mesh));
+			});
+		});
+	}
+
+	return _cached_models[path];
+}
+//------------------------------------------------------------------------------
+
+static_assert(sizeof(PackedVertex) == 20, "PackedVertex must match its attribute layout");
+
+// IEEE 754 binary16, round to nearest even. Denormals are kept, values past
+// the largest half become infinity
+static uint16_t half_from_float(float f)
+{
+	uint32_t x;
+	memcpy(&x, &f, sizeof(x));
+
+	uint32_t sign = (x >> 16) & 0x8000;
+	int exp = (int)((x >> 23) & 0xFF) - 127 + 15;
+	uint32_t mant = x & 0x7FFFFF;
+
+	if(((x >> 23) & 0xFF) == 0xFF) return sign | 0x7C00 | (mant ? 0x200 : 0);
+	if(exp >= 31) return sign | 0x7C00;
+	if(exp <= 0)
+	{
+		if(exp < -10) return sign;
+		mant |= 0x800000;
+		int shift = 14 - exp;
+		uint32_t half = mant >> shift, rest = mant & ((1 << shift) - 1), mid = 1 << (shift - 1);
+		if(rest > mid || (rest == mid && (half & 1))) ++half;
+		return sign | half;
+	}
+
+	uint32_t half = (exp << 10) | (mant >> 13), rest = mant & 0x1FFF;
+	if(rest > 0x1000 || (rest == 0x1000 && (half & 1))) ++half; // may carry into the exponent, which is correct
+	return sign | half;
+}
+
+//------------------------------------------------------------------------------
+// Octahedral unit vector encoding (Cigolle et al. 2014), snorm16 per axis
+static void oct_encode(int16_t out[2], const vec3 n)
+{
+	float l1 = fabsf(n[0]) + fabsf(n[1]) + fabsf(n[2]);
+	float x = 0, y = 0;
+
+	if(l1 > 0)
+	{
+		x = n[0] / l1;
+		y = n[1] / l1;
+
+		if(n[2] < 0)
+		{
+			float fx = (1.f - fabsf(y)) * (x >= 0 ? 1 : -1);
+			float fy = (1.f - fabsf(x)) * (y >= 0 ? 1 : -1);
+			x = fx; y = fy;
+		}
+	}
+
+	out[0] = (int16_t)roundf(std::min(std::max(x, -1.f), 1.f) * 32767.f);
+	out[1] = (int16_t)roundf(std::min(std::max(y, -1.f), 1.f) * 32767.f);
+}
+
+//------------------------------------------------------------------------------
+void PackedVertex::quantization(const Bounds& bounds, vec3 offset, vec3 scale)
+{
+	vec3_copy(offset, bounds.min.v);
+	for(int j = 3; j--;)
+	{
+		scale[j] = bounds.max.v[j] - bounds.min.v[j];
+	}
+}
+
+//------------------------------------------------------------------------------
+PackedVertex PackedVertex::pack(const Vertex& v, const vec3 offset, const vec3 scale)
+{
+	PackedVertex p;
+
+	for(int j = 3; j--;)
+	{
+		float q = scale[j] > 0 ? (v.position[j] - offset[j]) / scale[j] * 65535.f : 0;
+		p.position[j] = (uint16_t)std::min(std::max(roundf(q), 0.f), 65535.f);
+	}
+	p.position[3] = v.tangent[3] < 0 ? 0 : 65535;
+
+	oct_encode(p.normal, v.normal);
+	oct_encode(p.tangent, v.tangent);
+	p.texture[0] = half_from_float(v.texture[0]);
+	p.texture[1] = half_from_float(v.texture[1]);
+
+	return p;
+}
+
+//------------------------------------------------------------------------------
+Model::Model(Mesh* mesh, VertexFormat format, bool vertex_array)
 {
 	glGenBuffers(2, &vbo);
-	glBindBuffer(GL_ARRAY_BUFFER, vbo);
+	this->format = format;
+
+	if(vertex_array && RendererGL::version_major >= 3)
+	{
+		glGenVertexArrays(1, &vao);
+	}
+
+	upload(mesh);
+
+	// the layout never changes, even across uploads, so it's recorded
+	// once and drawing only binds it
+	if(vao)
+	{
+		glBindVertexArray(vao);
+		specify_attributes();
+		glBindVertexArray(0);
+	}
+}
+//------------------------------------------------------------------------------
 
+void Model::upload(Mesh* mesh)
+{
 	assert(mesh);
-	glBufferData(
-		GL_ARRAY_BUFFER,
-		mesh->vert_count() * sizeof(Vertex),
-		mesh->verts(),
-		GL_STATIC_DRAW
-	);
+
+	// the index buffer binding belongs to whichever vertex array is bound
+	GLuint array = vao ? vao : RendererGL::shared_vertex_array;
+	if(array) glBindVertexArray(array);
+
+	glBindBuffer(GL_ARRAY_BUFFER, vbo);
+
+	if(format == VertexFormat::PACKED && mesh->vert_count())
+	{
+		// positions are stored relative to the mesh's bounds, the shader
+		// gets the offset and scale to undo it as uniforms
+		Vertex* v = mesh->verts();
+		std::vector<PackedVertex> packed(mesh->vert_count());
+
+		PackedVertex::quantization(mesh->bounds(), position_offset.v, position_scale.v);
+
+		for(unsigned int i = 0; i < packed.size(); ++i)
+		{
+			packed[i] = PackedVertex::pack(v[i], position_offset.v, position_scale.v);
+		}
+
+		glBufferData(
+			GL_ARRAY_BUFFER,
+			packed.size() * sizeof(PackedVertex),
+			packed.data(),
+			GL_STATIC_DRAW
+		);
+	}
+	else
+	{
+		glBufferData(
+			GL_ARRAY_BUFFER,
+			mesh->vert_count() * sizeof(Vertex),
+			mesh->verts(),
+			GL_STATIC_DRAW
+		);
+	}
+
+	index_type = mesh->index_type();
+
+	std::vector<uint16_t> scratch;
+	size_t index_size = index_type == GL_UNSIGNED_SHORT ? sizeof(uint16_t) : sizeof(uint32_t);
+
+	// every LOD level shares the vertex buffer and is packed back to back
+	// into one index buffer, level 0 first
+	size_t total = mesh->index_count();
+	for(unsigned int i = 1; i < mesh->lod_count(); ++i)
+	{
+		total += mesh->lod_inds(i).size();
+	}
 
 	glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, ibo);
-	glBufferData(
+	glBufferData(GL_ELEMENT_ARRAY_BUFFER, total * index_size, NULL, GL_STATIC_DRAW);
+
+	lods.clear();
+	lods.push_back({ 0, mesh->index_count() });
+	glBufferSubData(
 		GL_ELEMENT_ARRAY_BUFFER,
-		mesh->index_count() * sizeof(uint16_t),
-		mesh->inds(),
-		GL_STATIC_DRAW
+		0,
+		mesh->index_count() * index_size,
+		mesh->index_buffer(scratch)
 	);
 
+	for(unsigned int i = 1; i < mesh->lod_count(); ++i)
+	{
+		std::vector<uint32_t>& level = mesh->lod_inds(i);
+		const void* data = level.data();
+		size_t offset = lods.back().offset + lods.back().count * index_size;
+
+		if(index_type == GL_UNSIGNED_SHORT)
+		{
+			scratch.assign(level.begin(), level.end());
+			data = scratch.data();
+		}
+
+		lods.push_back({ offset, (unsigned int)level.size() });
+		glBufferSubData(GL_ELEMENT_ARRAY_BUFFER, offset, level.size() * index_size, data);
+	}
+
 	vertices = mesh->vert_count();
 	indices  = mesh->index_count();
+	mesh_bounds = mesh->bounds();
+
+	if(array) glBindVertexArray(0);
 }
 //------------------------------------------------------------------------------
 
-Model::~Model()
+const Bounds& Model::bounds()
 {
-    glDeleteBuffers(1, &vbo);
+	return mesh_bounds;
 }
 //------------------------------------------------------------------------------
 
-void Model::draw()
+Bounds Model::world_bounds()
 {
-	assert(gl_get_error());
+	return mesh_bounds.transformed(world().v);
+}
+//------------------------------------------------------------------------------
+
+Model::~Model()
+{
+	glDeleteBuffers(2, &vbo);
+
+	if(vao) glDeleteVertexArrays(1, &vao);
+}
+//------------------------------------------------------------------------------
 
+void Model::specify_attributes()
+{
 	glBindBuffer(GL_ARRAY_BUFFER, vbo);
-	assert(gl_get_error());
 
-	glEnableVertexAttribArray(0);
-	assert(gl_get_error());
-	glEnableVertexAttribArray(1);
-	assert(gl_get_error());
-	glEnableVertexAttribArray(2);
+	for(int i = 4; i--;)
+	{
+		glEnableVertexAttribArray(i);
+	}
+
+	if(format == VertexFormat::PACKED)
+	{
+		const GLsizei stride = sizeof(PackedVertex);
+		glVertexAttribPointer(0, 4, GL_UNSIGNED_SHORT, GL_TRUE, stride, (void*)offsetof(PackedVertex, position));
+		glVertexAttribPointer(1, 2, GL_SHORT, GL_TRUE, stride, (void*)offsetof(PackedVertex, normal));
+		glVertexAttribPointer(2, 2, GL_SHORT, GL_TRUE, stride, (void*)offsetof(PackedVertex, tangent));
+		glVertexAttribPointer(3, 2, GL_HALF_FLOAT, GL_FALSE, stride, (void*)offsetof(PackedVertex, texture));
+	}
+	else
+	{
+		const GLsizei stride = sizeof(Vertex);
+		glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, stride, (void*)offsetof(Vertex, position));
+		glVertexAttribPointer(1, 3, GL_FLOAT, GL_FALSE, stride, (void*)offsetof(Vertex, normal));
+		glVertexAttribPointer(2, 4, GL_FLOAT, GL_FALSE, stride, (void*)offsetof(Vertex, tangent));
+		glVertexAttribPointer(3, 3, GL_FLOAT, GL_FALSE, stride, (void*)offsetof(Vertex, texture));
+	}
+
+	// for programs reading their transforms from the ring
+	if(ObjectRing::supported())
+	{
+		Objects.bind_attribute();
+	}
+
+	glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, ibo);
+
 	assert(gl_get_error());
-	glEnableVertexAttribArray(3);
+}
+//------------------------------------------------------------------------------
+
+void Model::draw()
+{
 	assert(gl_get_error());
 
-	for(int i = 4; i--;)
+	GLuint array = vao ? vao : RendererGL::shared_vertex_array;
+	if(array) glBindVertexArray(array);
+
+	if(!vao)
 	{
-		glVertexAttribPointer(i, 3, GL_FLOAT, GL_FALSE, sizeof(Vertex), (void*)(sizeof(vec3) * i));
+		specify_attributes();
 	}
 
+	ShaderProgram& shader = *ShaderProgram::active();
 
-	assert(gl_get_error());
+	if(format == VertexFormat::PACKED)
+	{
+		static const Uniform u_position_offset("u_position_offset");
+		static const Uniform u_position_scale("u_position_scale");
+
+		shader[u_position_offset] << position_offset;
+		shader[u_position_scale] << position_scale;
+	}
+
+	GLuint object = 0;
 
-	*ShaderProgram::active() << (Positionable*)this;
+	if (shader.object_indexed)
+	{
+		object = Objects.push(world().v, normal_matrix.v);
+	}
+	else
+	{
+		shader << (Positionable*)this;
+	}
 
 	assert(gl_get_error());
 
-	glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, ibo);
+	if (shader.primative == GL_PATCHES)
+	{
+		glPatchParameteri(GL_PATCH_VERTICES, 3);
+	}
 
-	glPatchParameteri(GL_PATCH_VERTICES, 3);
-	assert(gl_get_error());
-	// glDrawArrays(GL_PATCHES, 0, vertices);
-	glDrawElements(ShaderProgram::active()->primative, indices, GL_UNSIGNED_SHORT, 0);
+	LOD& lod = lods[select_lod()];
+
+	if (shader.object_indexed)
+	{
+		// a single instance, its base instance selects the transform
+		glDrawElementsInstancedBaseInstance(shader.primative, lod.count, index_type, (void*)lod.offset, 1, object);
+	}
+	else
+	{
+		glDrawElements(shader.primative, lod.count, index_type, (void*)lod.offset);
+	}
 
 	assert(gl_get_error());
 
-	for(int i = 4; i--;)
+	if(!vao) for(int i = 4; i--;)
 	{
 		glDisableVertexAttribArray(i);
 	}
 
+	if(array) glBindVertexArray(0);
+
 	assert(gl_get_error());
 }
+//------------------------------------------------------------------------------
+
+unsigned int Model::select_lod()
+{
+	Viewer* viewer = Viewer::active;
+
+	if(lods.size() < 2 || !viewer || mesh_bounds.radius <= 0)
+	{
+		return 0;
+	}
+
+	Bounds bounds = world_bounds();
+	vec4 center = { bounds.center.x, bounds.center.y, bounds.center.z, 1 }, view;
+	mat4x4_mul_vec4(view, viewer->_view.v, center);
+
+	// Projected radius as a fraction of half the viewport's height. Each
+	// level is used while the model covers half the size of the previous
+	float dist = vec3_len(view);
+	if(dist <= bounds.radius)
+	{
+		return 0;
+	}
+
+	float size = bounds.radius * viewer->_projection.v[1][1] / dist;
+	unsigned int level = 0;
+	for(float limit = lod_bias; size < limit * 0.5f && level + 1 < lods.size(); limit *= 0.5f)
+	{
+		++level;
+	}
+
+	return level;
+}
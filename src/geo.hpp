@@ -4,6 +4,7 @@
 #include "texture.hpp"
 
 #define STL_HEADER_SIZE 80
+#define STL_TRI_SIZE 50
 
 namespace seen
 {
@@ -13,12 +14,14 @@ namespace seen
 //   \__ \ | | | |__
 //   |___/ |_| |____|
 //
+#pragma pack(push, 1)
 struct STLTri
 {
-	Vec3* normal;
-	Vec3* verts;
+	float normal[3];
+	float verts[3][3];
 	uint16_t attr;
 };
+#pragma pack(pop)
 //------------------------------------------------------------------------------
 struct STLVert
 {
@@ -30,47 +33,275 @@ struct Vertex
 {
 	vec3 position;
 	vec3 normal;
-	vec3 tangent;
+	vec4 tangent; // w < 0 where the uv mapping is mirrored
 	vec3 texture;
 };
 //------------------------------------------------------------------------------
+struct Bounds
+{
+	Vec3 min, max;   // axis aligned box
+	Vec3 center;     // sphere around every vertex
+	float radius = 0;
+
+	/**
+	 * @brief box and sphere enclosing these bounds once moved by world
+	 */
+	Bounds transformed(mat4x4 world);
+};
+//------------------------------------------------------------------------------
+/**
+ * @brief 20 byte vertex for Models uploaded as VertexFormat::PACKED, read by
+ *        shaders built with Shader::VERT_PACKED
+ */
+struct PackedVertex
+{
+	uint16_t position[4]; // unorm16 within the mesh's bounds, w 0 if the tangent's mirrored
+	int16_t normal[2];    // snorm16 octahedral
+	int16_t tangent[2];   // snorm16 octahedral
+	uint16_t texture[2];  // half float
+
+	/**
+	 * @brief uniforms a VERT_PACKED shader decodes positions within bounds
+	 *        with, as offset + position * scale. Positions reach the
+	 *        shader normalized to [0, 1], so scale is the box's extent.
+	 */
+	static void quantization(const Bounds& bounds, vec3 offset, vec3 scale);
+
+	/**
+	 * @brief quantize and encode v, for the offset and scale above
+	 */
+	static PackedVertex pack(const Vertex& v, const vec3 offset, const vec3 scale);
+};
+//------------------------------------------------------------------------------
+enum class VertexFormat {
+	FLOAT,
+	PACKED,
+};
+//------------------------------------------------------------------------------
+struct VertexCacheReport
+{
+	float acmr_before, acmr_after; // cache misses per triangle
+	float atvr_before, atvr_after; // cache misses per vertex
+};
+//------------------------------------------------------------------------------
+/**
+ * @brief open addressing table mapping a key of three 32 bit words (an OBJ
+ *        corner's pos/tex/norm indices, or an STL position's float bits) to
+ *        the index of the vertex it produced. Linear probing, power of two
+ *        capacity, grown before it passes half full.
+ */
+struct VertexTable
+{
+	struct Slot {
+		uint32_t key[3];
+		uint32_t index;
+	};
+
+	static const uint32_t empty = 0xFFFFFFFF;
+
+	VertexTable(size_t expected)
+	{
+		size_t capacity = 16;
+		while(capacity < expected * 2) capacity <<= 1;
+		resize(capacity);
+	}
+
+	// returns the existing index of the triple, or inserts and returns next_index
+	uint32_t find_or_insert(const uint32_t key[3], uint32_t next_index)
+	{
+		if((count + 1) * 2 > slots.size())
+		{
+			resize(slots.size() * 2);
+		}
+
+		Slot* s = probe(key);
+		if(s->index == empty)
+		{
+			memcpy(s->key, key, sizeof(s->key));
+			s->index = next_index;
+			++count;
+		}
+
+		return s->index;
+	}
+
+private:
+	std::vector<Slot> slots;
+	size_t count = 0;
+
+	static inline uint64_t hash(const uint32_t key[3])
+	{
+		uint64_t h = ((uint64_t)key[0] << 32 | key[1]) * 0x9E3779B97F4A7C15ULL;
+		h ^= (uint64_t)key[2] * 0xC2B2AE3D27D4EB4FULL;
+		return h ^ (h >> 29);
+	}
+
+	Slot* probe(const uint32_t key[3])
+	{
+		size_t mask = slots.size() - 1;
+		for(size_t i = hash(key) & mask;; i = (i + 1) & mask)
+		{
+			Slot* s = &slots[i];
+			if(s->index == empty ||
+			   (s->key[0] == key[0] && s->key[1] == key[1] && s->key[2] == key[2]))
+			{
+				return s;
+			}
+		}
+	}
+
+	void resize(size_t capacity)
+	{
+		std::vector<Slot> old;
+		old.swap(slots);
+		slots.assign(capacity, Slot{ { 0, 0, 0 }, empty });
+
+		for(auto& s : old) if(s.index != empty)
+		{
+			*probe(s.key) = s;
+		}
+	}
+};
+//------------------------------------------------------------------------------
 struct Mesh
 {
-	unsigned int vert_count();
-	unsigned int index_count();
-	Vertex* verts();
-	uint16_t* inds();
+	virtual ~Mesh() = default;
+
+	virtual unsigned int vert_count();
+	virtual unsigned int index_count();
+	virtual Vertex* verts();
+	uint32_t* inds();
+
+	/**
+	 * @brief narrowest GL index type able to address every vertex
+	 * @return GL_UNSIGNED_SHORT or GL_UNSIGNED_INT
+	 */
+	virtual GLenum index_type();
 
-	Vec3 *_min, *_max;
+	/**
+	 * @brief index_count() indices laid out as index_type(), ready to upload
+	 * @param scratch storage the indices may be narrowed into
+	 */
+	virtual const void* index_buffer(std::vector<uint16_t>& scratch);
 
-	void compute_normals();
-	void compute_tangents();
+	/**
+	 * @brief area weighted vertex normals from the triangles sharing each
+	 *        vertex
+	 * @param threads workers the triangles and vertices are split across
+	 */
+	void compute_normals(int threads=1);
+
+	/**
+	 * @brief uv aligned tangents, accumulated per vertex as MikkTSpace does
+	 *        and orthogonal to the current normals. The bitangent's sign
+	 *        goes in tangent[3]
+	 */
+	void compute_tangents(int threads=1);
+
+	/**
+	 * @brief box and sphere around every vertex. Loaders compute them as
+	 *        they finish, anything else on first use
+	 */
+	const Bounds& bounds();
+
+	/**
+	 * @brief rescan the vertices, after they've been moved
+	 */
+	void compute_bounds();
 
 	Vec3 min_position();
 	Vec3 max_position();
 	Vec3 box_dimensions();
 
+	/**
+	 * @brief reorder triangles for the post-transform vertex cache, then
+	 *        for overdraw, then reorder vertices for fetch locality. The
+	 *        geometry is unchanged, only its ordering.
+	 * @param cache_size entries in the simulated FIFO vertex cache
+	 */
+	VertexCacheReport optimize(int cache_size=16);
+
+	/**
+	 * @brief simplify by quadric error half edge collapse. UV seams, normal
+	 *        splits and open borders are kept intact.
+	 * @param target_ratio fraction of the triangles to keep
+	 * @return indices referencing this mesh's unchanged vertices
+	 */
+	std::vector<uint32_t> simplify(float target_ratio);
+
+	/**
+	 * @brief build a chain of simplified levels, each keeping 'ratio' of
+	 *        the previous level's triangles. Level 0 is the full mesh.
+	 */
+	void generate_lods(int levels=4, float ratio=0.5f);
+	unsigned int lod_count();
+	std::vector<uint32_t>& lod_inds(unsigned int level);
+
 protected:
 	std::vector<vec3_t> positions;
 	std::vector<vec3_t> tex_coords;
 	std::vector<vec3_t> normals;
 
 	std::vector<vec3_t> params;
-	std::vector<uint16_t> indices;
+	std::vector<uint32_t> indices;
 	std::vector<Vertex> vertices;
+	std::vector<std::vector<uint32_t>> lod_indices;
+
+	Bounds _bounds;
+	bool _has_bounds = false;
 };
 
 //------------------------------------------------------------------------------
 struct Model : Drawable, Positionable
 {
 public:
-	Model(Mesh* mesh);
+	/**
+	 * @param vertex_array record the attribute layout once in a vertex
+	 *        array object, where the context has them. Otherwise it's
+	 *        specified again on every draw.
+	 */
+	Model(Mesh* mesh, VertexFormat format=VertexFormat::FLOAT, bool vertex_array=true);
 	~Model();
 
 	void draw();
+
+	/**
+	 * @brief replace the model's contents with mesh, reusing its buffers
+	 */
+	void upload(Mesh* mesh);
+
+	/**
+	 * @brief scales the screen sizes at which coarser levels are chosen.
+	 *        Larger values keep detail longer.
+	 */
+	float lod_bias = 1;
+
+	/**
+	 * @brief bounds of the uploaded mesh, in model space
+	 */
+	const Bounds& bounds();
+
+	/**
+	 * @brief bounds moved by the model's current world matrix
+	 */
+	Bounds world_bounds();
 private:
+	struct LOD {
+		size_t offset;
+		unsigned int count;
+	};
+
+	unsigned int select_lod();
+	void specify_attributes();
+
 	GLuint vbo, ibo;
+	GLuint vao = 0; // stays 0 for contexts older than 3.0, or if not asked for
+	GLenum index_type;
+	VertexFormat format;
+	vec3_t position_offset, position_scale;
 	unsigned int vertices, indices;
+	std::vector<LOD> lods;
+	Bounds mesh_bounds;
 };
 
 //------------------------------------------------------------------------------
@@ -79,40 +310,89 @@ struct STLMesh : Mesh
 	uint8_t header[STL_HEADER_SIZE];
 	uint32_t tri_count;
 
-	Vertex* all_verts;
-	Vec3* all_positions;
-	Vec3* all_normals;
-	STLTri* tris;
-
 	STLMesh(int fd);
-	~STLMesh();
+	~STLMesh() = default;
+};
+
+//------------------------------------------------------------------------------
+struct BakedMeshHeader
+{
+	char magic[4];
+	uint32_t version;
+	uint32_t vertex_size;
+	uint32_t index_type;
+	uint32_t vert_count;
+	uint32_t index_count;
+	int64_t source_mtime;
+	uint64_t source_size;
+	float min[3], max[3];
+	float center[3], radius;
+	uint32_t lod_levels; // MeshFactory::lod_levels it was baked with
+	uint32_t lod_count;  // simplified levels stored after the indices
+};
+
+//------------------------------------------------------------------------------
+struct BakedMesh : Mesh
+{
+	BakedMesh(void* map, size_t size);
+	~BakedMesh();
+
 	unsigned int vert_count();
+	unsigned int index_count();
 	Vertex* verts();
+	GLenum index_type();
+	const void* index_buffer(std::vector<uint16_t>& scratch);
 
-	Vec3 min_position();
-	Vec3 max_position();
+	static const uint32_t version = 3;
 
 private:
-	Vec3 *_min, *_max;
-	unsigned int* _indices;
+	void* _map;
+	size_t _size;
+	BakedMeshHeader* _header;
 };
 
 //------------------------------------------------------------------------------
 class MeshFactory
 {
 public:
-	static Mesh* get_mesh(std::string path);
+	/**
+	 * @brief load (or fetch from cache) the mesh at path
+	 * @param threads number of workers an OBJ may be parsed with in parallel
+	 */
+	static Mesh* get_mesh(std::string path, int threads=1);
 	static Model* get_model(std::string path);
+
+	/**
+	 * @brief load the mesh on a worker thread, and upload it through the
+	 *        Loader's queue. Must be called from the GL context thread.
+	 * @return future that becomes ready once the model has been uploaded
+	 */
+	static std::shared_future<Model*> get_model_async(std::string path);
+
+	/**
+	 * @brief when set, meshes are cached as '<asset>.baked' beside their source
+	 */
+	static bool use_baked;
+
+	/**
+	 * @brief length of the LOD chain generated for each mesh parsed from
+	 *        source. 1, the default, skips simplification, so loading
+	 *        pays for it only in scenes that set this before loading.
+	 *        The chain is baked with the mesh, blobs baked with another
+	 *        length are rebuilt
+	 */
+	static int lod_levels;
+
+private:
+	static Mesh* load_baked(std::string path, struct stat& source);
+	static bool bake(Mesh* mesh, std::string path, struct stat& source);
 };
 
 //------------------------------------------------------------------------------
 struct OBJMesh : Mesh
 {
-	OBJMesh(int fd);
+	OBJMesh(int fd, int threads=1);
 	~OBJMesh();
-
-	unsigned int vert_count();
-	Vertex* verts();
 };
 
 //------------------------------------------------------------------------------
@@ -127,23 +407,176 @@ struct Plane : Mesh
 //------------------------------------------------------------------------------
 struct Heightmap : Plane
 {
+	/**
+	 * @brief heights come from the PNG's first channel, 8 or 16 bit,
+	 *        resampled to resolution x resolution vertices
+	 */
 	Heightmap(std::string path, float size, int resolution);
+
+	/**
+	 * @brief as above, but read back from a texture already on the GPU
+	 */
 	Heightmap(Tex texture, float size, int resolution);
-	~Heightmap();
+	~Heightmap() = default;
 
 private:
-	void generate(Tex t, int resolution);
+	void generate(const float* heights, int width, int height, int resolution, float size);
 };
 
 //------------------------------------------------------------------------------
 struct Volume : Mesh
 {
+	/**
+	 * @brief fills density[i] for the point x[i], y[i], z[i]. The arrays
+	 *        are 32 byte aligned and count is always a multiple of 8
+	 */
+	typedef std::function<void(const float* x, const float* y, const float* z, float* density, size_t count)> DensityBatch;
+
 	Volume(Vec3 corner0, Vec3 corner1, int divisions);
 
-	void generate(float(*density_at)(vec3 loc));
+	/**
+	 * @brief polygonize the surface where density_at crosses 0
+	 * @param density_at called concurrently when threads > 1
+	 * @param threads number of workers the grid is split across. Output
+	 *        is identical for any thread count
+	 */
+	void generate(float(*density_at)(vec3 loc), int threads=1);
+
+	/**
+	 * @brief as above, but densities are requested a whole lattice plane
+	 *        at a time, so the callable can vectorize and carry state
+	 */
+	void generate(DensityBatch density_at, int threads=1);
+
+	/**
+	 * @brief upper bound on the density's gradient magnitude. When set,
+	 *        regions the bound proves can't hold surface are never sampled
+	 *        or walked, so meshing scales with surface area, not volume.
+	 *        1 for a true signed distance field. 0 disables the pre-pass
+	 */
+	float lipschitz = 0;
 private:
 	int _divisions;
 	Vec3 _corners[2];
 };
 
+//------------------------------------------------------------------------------
+/**
+ * @brief a density field split into a grid of bricks, each meshed into its
+ *        own Model. Edits only remesh the bricks they reach, on the Loader's
+ *        workers, and the results are swapped in as uploads are processed.
+ */
+class ChunkedVolume : public Drawable
+{
+public:
+	/**
+	 * @param chunks bricks along each axis
+	 * @param chunk_divisions voxels along each axis of a brick
+	 * @param density called concurrently from the Loader's workers
+	 */
+	ChunkedVolume(Vec3 corner0, Vec3 corner1, int chunks, int chunk_divisions, Volume::DensityBatch density);
+	~ChunkedVolume();
+
+	void add_sphere(Vec3 center, float radius);
+	void subtract_sphere(Vec3 center, float radius);
+
+	/**
+	 * @brief queue remeshing of dirty bricks, then draw every brick
+	 */
+	void draw();
+
+	/**
+	 * @brief bricks edited or being remeshed, whose Models are stale
+	 */
+	int pending_chunks();
+
+private:
+	struct Edit {
+		Vec3 center;
+		float radius;
+		bool add;
+	};
+
+	struct Chunk {
+		Vec3 corners[2];
+		Model* model;
+		bool dirty, meshing;
+
+		// densities at every lattice point the brick samples, with every
+		// edit up to its last remesh folded in. Later edits wait in
+		// 'edits' until the next remesh bakes them
+		std::shared_ptr<const std::vector<float>> field;
+		std::vector<Edit> edits;
+	};
+
+	bool reaches(const Edit& edit, const Chunk& chunk);
+	void edit(Edit edit);
+	void remesh(int index);
+
+	Volume::DensityBatch _density;
+	int _chunk_divisions;
+	float _voxel_size;
+	std::vector<Chunk> _chunks;
+
+	// outstanding uploads check this before touching the volume
+	std::shared_ptr<bool> _alive;
+};
+
+//------------------------------------------------------------------------------
+/**
+ * @brief quadtree terrain drawn from one small grid patch, displaced and
+ *        morphed between levels in the vertex shader. Vertex cost stays
+ *        constant however large the heightmap is. Draw it with
+ *        ShaderProgram::builtin_terrain(), or a program that starts with
+ *        Shader::terrain_displaced().
+ */
+class Terrain : public Drawable
+{
+public:
+	/**
+	 * @param path PNG whose first channel is height, 8 or 16 bit. Columns
+	 *        run along x, rows along z
+	 * @param size world width of the square terrain, centered on the origin
+	 * @param height world height of a full intensity texel
+	 * @param levels depth of the quadtree
+	 * @param patch_resolution quads along each side of a node, a multiple of 4
+	 */
+	Terrain(std::string path, float size, float height, int levels=8, int patch_resolution=32);
+	~Terrain();
+
+	void draw();
+
+	/**
+	 * @brief distance at which the finest level gives way to the next.
+	 *        Each coarser level covers twice the distance
+	 */
+	float lod_distance;
+
+	/**
+	 * @brief patches drawn last frame, a quarter node each
+	 */
+	int selected_patches();
+
+private:
+	struct Node {
+		float x, z, size;
+		int lod;
+	};
+
+	bool select(int depth, int x, int z, Vec3 eye);
+	bool in_range(int depth, int x, int z, Vec3 eye, float range);
+	void add_quadrant(int depth, int x, int z, int lod);
+
+	Tex _heights;
+	int _width, _height;
+	float _size, _scale;
+	int _levels, _patch_resolution;
+	Model* _patch;
+
+	// per depth, min and max height of every node, row major
+	std::vector<std::vector<float>> _bounds;
+	std::vector<float> _ranges;
+	std::vector<Node> _selection;
+};
+
 }
@@ -48,12 +48,19 @@ public:
 
 	mat4x4_t _view;
 	mat4x4_t _projection;
+
+	/**
+	 * @brief the viewer the current frame is being drawn for
+	 */
+	static Viewer* active;
 };
 
 
 class Drawable
 {
 public:
+	virtual ~Drawable() {};
+
 	virtual void draw() = 0;
 };
 
@@ -0,0 +1,105 @@
+#include "loader.hpp"
+
+seen::AsyncLoader seen::Loader;
+
+using namespace seen;
+
+//------------------------------------------------------------------------------
+AsyncLoader::AsyncLoader(int threads)
+{
+	_threads = std::max(1, threads);
+	_running = true;
+}
+//------------------------------------------------------------------------------
+
+AsyncLoader::~AsyncLoader()
+{
+	{
+		std::unique_lock<std::mutex> lock(_work_mutex);
+		_running = false;
+	}
+
+	_work_cond.notify_all();
+
+	for (auto& worker : _workers)
+	{
+		worker.join();
+	}
+}
+//------------------------------------------------------------------------------
+
+void AsyncLoader::enqueue(std::function<void()> work)
+{
+	std::unique_lock<std::mutex> lock(_work_mutex);
+
+	// workers are started lazily, so programs that never load anything
+	// asynchronously never pay for them
+	while ((int)_workers.size() < _threads)
+	{
+		_workers.push_back(std::thread(&AsyncLoader::work, this));
+	}
+
+	_work.push_back(work);
+	_work_cond.notify_one();
+}
+//------------------------------------------------------------------------------
+
+void AsyncLoader::upload(size_t bytes, std::function<void()> gl_work)
+{
+	std::unique_lock<std::mutex> lock(_upload_mutex);
+	_uploads.push_back({ bytes, gl_work });
+}
+//------------------------------------------------------------------------------
+
+size_t AsyncLoader::process_uploads(size_t budget)
+{
+	size_t spent = 0;
+
+	for (;;)
+	{
+		Upload next;
+
+		{
+			std::unique_lock<std::mutex> lock(_upload_mutex);
+
+			if (_uploads.empty()) break;
+			if (spent > 0 && spent + _uploads.front().bytes > budget) break;
+
+			next = _uploads.front();
+			_uploads.pop_front();
+		}
+
+		next.gl_work();
+		spent += next.bytes;
+	}
+
+	return spent;
+}
+//------------------------------------------------------------------------------
+
+size_t AsyncLoader::pending_uploads()
+{
+	std::unique_lock<std::mutex> lock(_upload_mutex);
+	return _uploads.size();
+}
+//------------------------------------------------------------------------------
+
+void AsyncLoader::work()
+{
+	for (;;)
+	{
+		std::function<void()> job;
+
+		{
+			std::unique_lock<std::mutex> lock(_work_mutex);
+			_work_cond.wait(lock, [&]{ return !_running || !_work.empty(); });
+
+			if (_work.empty()) return;
+
+			job = _work.front();
+			_work.pop_front();
+		}
+
+		job();
+	}
+}
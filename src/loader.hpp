@@ -0,0 +1,55 @@
+#pragma once
+
+#include "core.h"
+
+namespace seen
+{
+
+class AsyncLoader
+{
+public:
+	AsyncLoader(int threads=2);
+	~AsyncLoader();
+
+	/**
+	 * @brief run work (file I/O, parsing, decoding) on a worker thread
+	 */
+	void enqueue(std::function<void()> work);
+
+	/**
+	 * @brief queue a GL upload of roughly 'bytes' for the context thread
+	 */
+	void upload(size_t bytes, std::function<void()> gl_work);
+
+	/**
+	 * @brief run queued uploads on the calling thread until budget bytes
+	 *        have been spent. At least one upload runs if any are queued.
+	 * @return number of bytes uploaded
+	 */
+	size_t process_uploads(size_t budget);
+
+	size_t pending_uploads();
+
+private:
+	struct Upload {
+		size_t bytes;
+		std::function<void()> gl_work;
+	};
+
+	void work();
+
+	int _threads;
+	bool _running;
+	std::vector<std::thread> _workers;
+
+	std::mutex _work_mutex;
+	std::condition_variable _work_cond;
+	std::deque<std::function<void()>> _work;
+
+	std::mutex _upload_mutex;
+	std::deque<Upload> _uploads;
+};
+
+extern AsyncLoader Loader;
+
+}
@@ -2,6 +2,7 @@
 #include "texture.hpp"
 #include "geo.hpp"
 #include "shader.hpp"
+#include "loader.hpp"
 
 #include <png.h>
 
@@ -17,6 +18,7 @@ static RendererGL* SINGLTON;
 
 int RendererGL::version_major = 0;
 int RendererGL::version_minor = 0;
+GLuint RendererGL::shared_vertex_array = 0;
 
 static void key_callback(GLFWwindow* window,
                          int key,
@@ -88,9 +90,8 @@ static GLFWwindow* init_glfw(int width, int height, const char* title, int versi
 
 	if (version[0] >= 3)
 	{
-		GLuint vao;
-		glGenVertexArrays(1, &vao);
-		glBindVertexArray(vao);
+		glGenVertexArrays(1, &RendererGL::shared_vertex_array);
+		glBindVertexArray(RendererGL::shared_vertex_array);
 		assert(gl_get_error());
 	}
 
@@ -114,6 +115,7 @@ RendererGL::RendererGL(
 {
 	width = win_w;
 	height = win_h;
+	upload_budget = 4 << 20;
 
 	DATA_PATH = std::string(data_path);
 
@@ -162,6 +164,17 @@ void RendererGL::draw(Viewer* viewer, std::vector<RenderingPass*> passes)
 
 	prepare(-1);
 
+	// finish a bounded amount of background loading on the context thread
+	Loader.process_uploads(upload_budget);
+
+	Viewer::active = viewer;
+
+	// camera and light once for every program that reads them from blocks
+	Shaders.update_blocks(viewer, light);
+
+	// waits out the GPU if it's still reading this frame's transforms
+	Objects.begin_frame();
+
 	glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
 
 	for (int key = 1024; key--;)
@@ -179,6 +192,8 @@ void RendererGL::draw(Viewer* viewer, std::vector<RenderingPass*> passes)
 		pass->finish();
 	}
 
+	Objects.end_frame();
+
 	assert(gl_get_error());
 
 	glfwPollEvents();
@@ -2,6 +2,7 @@
 
 #include "core.h"
 #include "camera.hpp"
+#include "light.hpp"
 
 namespace seen
 {
@@ -31,6 +32,18 @@ public:
 
 	int width, height;
 
+	/**
+	 * @brief bytes of queued asynchronous uploads performed each frame
+	 */
+	size_t upload_budget;
+
+	/**
+	 * @brief written to the shared light uniform block each frame, for
+	 *        programs built with Shader::uniform_blocks. A light that
+	 *        changes mid frame goes through Shaders.update_blocks().
+	 */
+	Light* light = nullptr;
+
 	std::function<void(double x, double y, double dx, double dy)> mouse_moved;
 	std::function<void(int key)> key_pressed;
 	std::function<void(int key)> key_released;
@@ -39,6 +52,12 @@ public:
 
 	static int version_major, version_minor;
 
+	/**
+	 * @brief vertex array for drawables without one of their own, which
+	 *        core contexts need bound to draw at all. 0 before 3.0.
+	 */
+	static GLuint shared_vertex_array;
+
 private:
 	double mouse_last_x, mouse_last_y;
 	GLFWwindow* _win;
@@ -11,3 +11,4 @@
 #include "renderergl.hpp"
 #include "listscene.hpp"
 #include "custompass.hpp"
+#include "loader.hpp"
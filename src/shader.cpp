@@ -3,9 +3,34 @@
 #include <iomanip>
 
 seen::ShaderCache seen::Shaders;
+seen::ObjectRing seen::Objects;
+
+const seen::UniformBlock seen::UniformBlock::frame = {
+	"seen_frame", 0, {
+		{ "mat4", "u_view_matrix" },
+		{ "mat4", "u_proj_matrix" },
+		{ "vec3", "u_view_position" },
+	}
+};
+
+const seen::UniformBlock seen::UniformBlock::light = {
+	"seen_light", 1, {
+		{ "mat4", "u_light_proj_matrix" },
+		{ "vec3", "u_light_position" },
+		{ "float", "u_light_ambience" },
+		{ "vec3", "u_light_power" },
+	}
+};
 
 using namespace seen;
 
+//------------------------------------------------------------------------------
+bool UniformBlock::supported()
+{
+	return RendererGL::version_major * 10 + RendererGL::version_minor >= 31;
+}
+//------------------------------------------------------------------------------
+
 
 GLint compile_source(const char* src, GLenum type)
 {
@@ -180,6 +205,7 @@ ShaderProgram& ShaderProgram::compile(std::string name, std::vector<Shader> shad
 	{
 		if (shader.type == GL_VERTEX_SHADER)
 		{
+			program.object_indexed |= shader._object_indexed;
 
 			for (unsigned int i = 0; i < shader.inputs.size(); i++)
 			{
@@ -194,16 +220,29 @@ ShaderProgram& ShaderProgram::compile(std::string name, std::vector<Shader> shad
 
 	program.program = link_program(gs_shaders, (const char**)attributes);
 	program.primative = GL_TRIANGLES;
+
+	// programs without a block just don't find it
+	for (auto block : { &UniformBlock::frame, &UniformBlock::light })
+	{
+		if (!UniformBlock::supported()) break;
+
+		GLuint index = glGetUniformBlockIndex(program.program, block->name);
+
+		if (index != GL_INVALID_INDEX)
+		{
+			glUniformBlockBinding(program.program, index, block->binding);
+		}
+	}
 	Shaders._program_cache[name] = program;
 
 	ShaderProgram& prog_ref = Shaders._program_cache[name];
 
-	// preload the uniforms
+	// resolve the uniforms up front, so drawing never asks GL for them
 	for (auto shader : shaders)
 	{
 		for (auto param : shader.parameters)
 		{
-			prog_ref[param.name];
+			prog_ref[Uniform(param.name.c_str())];
 		}
 	}
 
@@ -217,6 +256,13 @@ ShaderProgram& ShaderProgram::get(std::string name)
 }
 //------------------------------------------------------------------------------
 
+// builtins read their transforms from the ObjectRing wherever it works
+static int object_features()
+{
+	return ObjectRing::supported() ? Shader::VERT_OBJECT : 0;
+}
+//------------------------------------------------------------------------------
+
 ShaderProgram& ShaderProgram::builtin_sky()
 {
 	const std::string prog_name = "sky";
@@ -230,7 +276,8 @@ ShaderProgram& ShaderProgram::builtin_sky()
 	auto fsh = Shader::fragment("sky_fsh");
 
 	using Feature = seen::Shader::FeatureFlags;
-	vsh.vertex(Feature::VERT_POSITION | Feature::VERT_NORMAL | Feature::VERT_TANGENT | Feature::VERT_UV);
+	vsh.uniform_blocks = true;
+	vsh.vertex(Feature::VERT_POSITION | Feature::VERT_NORMAL | Feature::VERT_TANGENT | Feature::VERT_UV | object_features());
 	vsh.transformed()
 	   .next(vsh.local("l_pos_trans")["xyz"] *= "100.0")
 	   .viewed()
@@ -290,7 +337,8 @@ ShaderProgram& ShaderProgram::builtin_realistic()
 	}
 
 	auto vsh = seen::Shader::vertex("basic_vsh");
-	vsh.vertex(seen::Shader::VERT_POSITION | seen::Shader::VERT_NORMAL | seen::Shader::VERT_TANGENT | seen::Shader::VERT_UV)
+	vsh.uniform_blocks = true;
+	vsh.vertex(seen::Shader::VERT_POSITION | seen::Shader::VERT_NORMAL | seen::Shader::VERT_TANGENT | seen::Shader::VERT_UV | object_features())
 	   .transformed()
    	   .compute_binormal()
 	   .viewed().projected().pass_through("texcoord_in")
@@ -322,7 +370,7 @@ ShaderProgram& ShaderProgram::builtin_normal_colors()
 	auto fsh = Shader::fragment("normal_color_fsh");
 
 	using Feature = seen::Shader::FeatureFlags;
-	vsh.vertex(Feature::VERT_POSITION | Feature::VERT_NORMAL | Feature::VERT_TANGENT | Feature::VERT_UV);
+	vsh.vertex(Feature::VERT_POSITION | Feature::VERT_NORMAL | Feature::VERT_TANGENT | Feature::VERT_UV | object_features());
 	vsh.transformed()
 	   .viewed()
 	   .projected()
@@ -339,6 +387,35 @@ ShaderProgram& ShaderProgram::builtin_normal_colors()
 }
 //------------------------------------------------------------------------------
 
+ShaderProgram& ShaderProgram::builtin_terrain()
+{
+	const std::string prog_name = "terrain";
+
+	if (Shaders._program_cache.count(prog_name) == 1)
+	{
+		return Shaders._program_cache[prog_name];
+	}
+
+	auto vsh = Shader::vertex("terrain_vsh");
+	auto fsh = Shader::fragment("terrain_fsh");
+
+	using Feature = seen::Shader::FeatureFlags;
+	vsh.uniform_blocks = true;
+	vsh.vertex(Feature::VERT_POSITION | object_features());
+	vsh.terrain_displaced()
+	   .viewed()
+	   .projected()
+	   .emit_position()
+	   .next(vsh.builtin("gl_Position") = vsh.local("l_pos_proj"));
+
+	fsh.preceded_by(vsh);
+	fsh.color_textured()
+	   .blinn();
+
+	return seen::ShaderProgram::compile(prog_name, { vsh, fsh });
+}
+//------------------------------------------------------------------------------
+
 ShaderProgram& ShaderProgram::builtin_shadow_depth()
 {
 	const std::string prog_name = "shadow_depth";
@@ -352,7 +429,7 @@ ShaderProgram& ShaderProgram::builtin_shadow_depth()
 	auto fsh = Shader::fragment("shadow_depth_fsh");
 
 	using Feature = seen::Shader::FeatureFlags;
-	vsh.vertex(Feature::VERT_POSITION | Feature::VERT_NORMAL | Feature::VERT_TANGENT | Feature::VERT_UV);
+	vsh.vertex(Feature::VERT_POSITION | Feature::VERT_NORMAL | Feature::VERT_TANGENT | Feature::VERT_UV | object_features());
 	auto l_depth = vsh.local("l_depth").as(Shader::vec(4));
 	auto o_depth = vsh.output("depth_" + vsh.suffix()).as(Shader::vec(1));
 	vsh.transformed()
@@ -382,12 +459,24 @@ ShaderProgram& ShaderProgram::use()
 }
 //------------------------------------------------------------------------------
 
+static const Uniform u_view_matrix("u_view_matrix");
+static const Uniform u_proj_matrix("u_proj_matrix");
+static const Uniform u_view_position("u_view_position");
+static const Uniform u_world_matrix("u_world_matrix");
+static const Uniform u_normal_matrix("u_normal_matrix");
+static const Uniform u_light_position("u_light_position");
+static const Uniform u_light_power("u_light_power");
+static const Uniform u_light_ambience("u_light_ambience");
+static const Uniform u_light_proj_matrix("u_light_proj_matrix");
+static const Uniform u_shadow_cube("u_shadow_cube");
+//------------------------------------------------------------------------------
+
 void ShaderProgram::operator<<(Material* m)
 {
-	const std::string uniform_names[] = {
-		"u_color_sampler",
-		"u_normal_sampler",
-		"u_specular_sampler"
+	static const Uniform uniforms[] = {
+		Uniform("u_color_sampler"),
+		Uniform("u_normal_sampler"),
+		Uniform("u_specular_sampler")
 	};
 
 	for (int i = 3; i--;)
@@ -397,7 +486,7 @@ void ShaderProgram::operator<<(Material* m)
 
 		glActiveTexture(GL_TEXTURE0 + _tex_counter);
 		glBindTexture(GL_TEXTURE_2D, m->v[i]);
-		(*this)[uniform_names[i]] << _tex_counter;
+		(*this)[uniforms[i]] << _tex_counter;
 		_tex_counter++;
 	}
 }
@@ -405,31 +494,31 @@ void ShaderProgram::operator<<(Material* m)
 
 void ShaderProgram::operator<<(Viewer* v)
 {
-	(*this)["u_view_matrix"] << v->_view;
-	(*this)["u_proj_matrix"] << v->_projection;
-	(*this)["u_view_position"] << v->position();
+	(*this)[u_view_matrix] << v->_view;
+	(*this)[u_proj_matrix] << v->_projection;
+	(*this)[u_view_position] << v->position();
 }
 //------------------------------------------------------------------------------
 
 void ShaderProgram::operator<<(Positionable* p)
 {
-	(*this)["u_world_matrix"] << p->world();
-	(*this)["u_normal_matrix"] << p->normal_matrix;
+	(*this)[u_world_matrix] << p->world();
+	(*this)[u_normal_matrix] << p->normal_matrix;
 }
 //------------------------------------------------------------------------------
 
 void ShaderProgram::operator<<(Light* l)
 {
-	(*this)["u_light_position"] << l->position;
-	(*this)["u_light_power"] << l->power;
-	(*this)["u_light_ambience"] << l->ambience;
-	(*this)["u_light_proj_matrix"] << l->projection;
+	(*this)[u_light_position] << l->position;
+	(*this)[u_light_power] << l->power;
+	(*this)[u_light_ambience] << l->ambience;
+	(*this)[u_light_proj_matrix] << l->projection;
 }
 //------------------------------------------------------------------------------
 
 void ShaderProgram::operator<<(ShadowPass* s)
 {
-	(*this)["u_shadow_cube"] << s->_cubemap;
+	(*this)[u_shadow_cube] << s->_cubemap;
 }
 //------------------------------------------------------------------------------
 
@@ -445,6 +534,205 @@ ShaderCache::~ShaderCache()
 }
 //------------------------------------------------------------------------------
 
+void ShaderCache::update_blocks(Viewer* viewer, Light* light)
+{
+	if (!UniformBlock::supported()) return;
+
+	if (!_block_buffers[0])
+	{
+		glGenBuffers(2, _block_buffers);
+		glBindBuffer(GL_UNIFORM_BUFFER, _block_buffers[0]);
+		glBufferData(GL_UNIFORM_BUFFER, sizeof(FrameUniforms), nullptr, GL_DYNAMIC_DRAW);
+		glBindBuffer(GL_UNIFORM_BUFFER, _block_buffers[1]);
+		glBufferData(GL_UNIFORM_BUFFER, sizeof(LightUniforms), nullptr, GL_DYNAMIC_DRAW);
+	}
+
+	if (viewer)
+	{
+		update_frame_block(viewer->_view.v, viewer->_projection.v, viewer->position().v);
+	}
+
+	if (light)
+	{
+		LightUniforms block = {};
+		mat4x4_dup(block.proj_matrix, light->projection.v);
+		vec3_copy(block.position, light->position.v);
+		vec3_copy(block.power, light->power.v);
+		block.ambience = light->ambience;
+
+		glBindBuffer(GL_UNIFORM_BUFFER, _block_buffers[1]);
+		glBufferSubData(GL_UNIFORM_BUFFER, 0, sizeof(block), &block);
+	}
+
+	glBindBuffer(GL_UNIFORM_BUFFER, 0);
+	glBindBufferBase(GL_UNIFORM_BUFFER, UniformBlock::frame.binding, _block_buffers[0]);
+	glBindBufferBase(GL_UNIFORM_BUFFER, UniformBlock::light.binding, _block_buffers[1]);
+
+	assert(gl_get_error());
+}
+//------------------------------------------------------------------------------
+
+void ShaderCache::update_frame_block(mat4x4 view, mat4x4 proj, vec3 position)
+{
+	if (!UniformBlock::supported()) return;
+
+	if (!_block_buffers[0])
+	{
+		update_blocks(nullptr, nullptr);
+	}
+
+	FrameUniforms frame = {};
+	mat4x4_dup(frame.view_matrix, view);
+	mat4x4_dup(frame.proj_matrix, proj);
+	vec3_copy(frame.view_position, position);
+
+	glBindBuffer(GL_UNIFORM_BUFFER, _block_buffers[0]);
+	glBufferSubData(GL_UNIFORM_BUFFER, 0, sizeof(frame), &frame);
+	glBindBuffer(GL_UNIFORM_BUFFER, 0);
+
+	assert(gl_get_error());
+}
+//------------------------------------------------------------------------------
+
+// world matrix, then the normal matrix widened to a mat4, std430 packed
+static const int OBJECT_FLOATS = 32;
+//------------------------------------------------------------------------------
+
+ObjectRing::ObjectRing(unsigned int capacity)
+{
+	this->capacity = capacity;
+}
+//------------------------------------------------------------------------------
+
+bool ObjectRing::supported()
+{
+	return RendererGL::version_major * 10 + RendererGL::version_minor >= 44;
+}
+//------------------------------------------------------------------------------
+
+void ObjectRing::begin_frame()
+{
+	if (!supported()) return;
+
+	if (!_buffer)
+	{
+		allocate(capacity);
+	}
+
+	// only stalls if the GPU is frames behind
+	if (_fences[_slot])
+	{
+		while (glClientWaitSync(_fences[_slot], GL_SYNC_FLUSH_COMMANDS_BIT, 1000000) == GL_TIMEOUT_EXPIRED);
+		glDeleteSync(_fences[_slot]);
+		_fences[_slot] = 0;
+	}
+
+	_cursor = 0;
+	bind_slot();
+
+	assert(gl_get_error());
+}
+//------------------------------------------------------------------------------
+
+void ObjectRing::end_frame()
+{
+	if (!_buffer) return;
+
+	_fences[_slot] = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+	_slot = (_slot + 1) % frames;
+}
+//------------------------------------------------------------------------------
+
+GLuint ObjectRing::push(mat4x4 world, mat3x3 normal_matrix)
+{
+	assert(_mapped);
+
+	if (_cursor == capacity)
+	{
+		allocate(capacity * 2);
+		bind_slot();
+	}
+
+	GLuint index = _cursor++;
+	float* dst = _mapped + (_slot * capacity + index) * OBJECT_FLOATS;
+
+	memcpy(dst, world, sizeof(mat4x4));
+	dst += 16;
+
+	for (int c = 0; c < 4; c++)
+	for (int r = 0; r < 4; r++)
+	{
+		dst[c * 4 + r] = c < 3 && r < 3 ? normal_matrix[c][r] : 0;
+	}
+
+	return index;
+}
+//------------------------------------------------------------------------------
+
+void ObjectRing::allocate(unsigned int capacity)
+{
+	const GLbitfield flags = GL_MAP_WRITE_BIT | GL_MAP_PERSISTENT_BIT | GL_MAP_COHERENT_BIT;
+	GLsizeiptr size = capacity * OBJECT_FLOATS * sizeof(float) * frames;
+
+	// draws already issued keep reading the old buffer, GL only frees
+	// it once they're done. Transforms below the cursor aren't carried
+	// over, nothing drawn after this looks them up.
+	if (_buffer)
+	{
+		glDeleteBuffers(1, &_buffer);
+	}
+
+	glGenBuffers(1, &_buffer);
+	glBindBuffer(GL_SHADER_STORAGE_BUFFER, _buffer);
+	glBufferStorage(GL_SHADER_STORAGE_BUFFER, size, nullptr, flags);
+	_mapped = (float*)glMapBufferRange(GL_SHADER_STORAGE_BUFFER, 0, size, flags);
+	glBindBuffer(GL_SHADER_STORAGE_BUFFER, 0);
+
+	assert(_mapped);
+
+	// the index attribute has to count as high as the ring holds. VAOs
+	// refer to it by name, so respecifying it in place reaches them all
+	if (_indices)
+	{
+		std::vector<GLuint> indices(capacity);
+		for (GLuint i = 0; i < capacity; i++) { indices[i] = i; }
+
+		glBindBuffer(GL_ARRAY_BUFFER, _indices);
+		glBufferData(GL_ARRAY_BUFFER, capacity * sizeof(GLuint), indices.data(), GL_STATIC_DRAW);
+		glBindBuffer(GL_ARRAY_BUFFER, 0);
+	}
+
+	this->capacity = capacity;
+}
+//------------------------------------------------------------------------------
+
+void ObjectRing::bind_slot()
+{
+	GLsizeiptr slot_size = capacity * OBJECT_FLOATS * sizeof(float);
+	glBindBufferRange(GL_SHADER_STORAGE_BUFFER, binding, _buffer, _slot * slot_size, slot_size);
+}
+//------------------------------------------------------------------------------
+
+void ObjectRing::bind_attribute()
+{
+	if (!_indices)
+	{
+		// the index attribute reads element base instance, which is the index
+		std::vector<GLuint> indices(capacity);
+		for (GLuint i = 0; i < capacity; i++) { indices[i] = i; }
+
+		glGenBuffers(1, &_indices);
+		glBindBuffer(GL_ARRAY_BUFFER, _indices);
+		glBufferData(GL_ARRAY_BUFFER, capacity * sizeof(GLuint), indices.data(), GL_STATIC_DRAW);
+	}
+
+	glBindBuffer(GL_ARRAY_BUFFER, _indices);
+	glEnableVertexAttribArray(attribute);
+	glVertexAttribIPointer(attribute, 1, GL_UNSIGNED_INT, 0, (void*)0);
+	glVertexAttribDivisor(attribute, 1);
+}
+//------------------------------------------------------------------------------
+
 ShaderProgram* ShaderCache::operator[](ShaderConfig config)
 {
 	std::string name = config.vertex + config.fragment;
@@ -524,14 +812,71 @@ ShaderProgram* ShaderCache::operator[](ShaderConfig config)
 }
 //------------------------------------------------------------------------------
 
+struct UniformNames {
+	std::mutex lock;
+	std::map<std::string, unsigned int> ids;
+	std::deque<std::string> names; // stays put as it grows
+};
+
+static UniformNames& uniform_names()
+{
+	static UniformNames names;
+	return names;
+}
+//------------------------------------------------------------------------------
+
+Uniform::Uniform(const char* name)
+{
+	UniformNames& names = uniform_names();
+	std::lock_guard<std::mutex> guard(names.lock);
+
+	auto it = names.ids.find(name);
+	if (it == names.ids.end())
+	{
+		it = names.ids.insert({ name, (unsigned int)names.names.size() }).first;
+		names.names.push_back(name);
+	}
+
+	id = it->second;
+}
+//------------------------------------------------------------------------------
+
+const std::string& Uniform::name() const
+{
+	UniformNames& names = uniform_names();
+	std::lock_guard<std::mutex> guard(names.lock);
+
+	return names.names[id];
+}
+//------------------------------------------------------------------------------
+
+ShaderParam& ShaderProgram::operator[](const Uniform& uniform)
+{
+	if (uniform.id >= _params.size())
+	{
+		_params.resize(uniform.id + 1, nullptr);
+	}
+
+	// resolved on first use, by compile() for everything the program declares
+	ShaderParam*& param = _params[uniform.id];
+	if (!param)
+	{
+		param = new ShaderParam(this, uniform.name().c_str());
+	}
+
+	return *param;
+}
+//------------------------------------------------------------------------------
+
 ShaderParam& ShaderProgram::operator[](std::string name)
 {
-	if (_params.count(name) == 0)
+	auto it = _named.find(name);
+	if (it == _named.end())
 	{
-		_params[name] = new ShaderParam(this, name.c_str());
+		it = _named.insert({ name, &(*this)[Uniform(name.c_str())] }).first;
 	}
 
-	return *_params[name];
+	return *it->second;
 }
 //------------------------------------------------------------------------------
 
@@ -550,27 +895,51 @@ ShaderParam::ShaderParam(ShaderProgram* program, const char* name)
 }
 //------------------------------------------------------------------------------
 
+unsigned int ShaderParam::cache_hits;
+unsigned int ShaderParam::cache_misses;
+//------------------------------------------------------------------------------
+
+bool ShaderParam::changed(const void* value, size_t size)
+{
+	// not in the program, nothing to send or count
+	if (_uniform < 0) return false;
+
+	if (size == _shadow_size && memcmp(_shadow, value, size) == 0)
+	{
+		cache_hits++;
+		return false;
+	}
+
+	assert(size <= sizeof(_shadow));
+	memcpy(_shadow, value, size);
+	_shadow_size = size;
+	cache_misses++;
+
+	return true;
+}
+//------------------------------------------------------------------------------
+
 void ShaderParam::operator<<(float f)
 {
-	glUniform1f(_uniform, f);
+	if (changed(&f, sizeof(f))) glUniform1f(_uniform, f);
 }
 //------------------------------------------------------------------------------
 
 void ShaderParam::operator<<(vec3_t& v)
 {
-	glUniform3fv(_uniform, 1, (GLfloat*)v.v);
+	if (changed(v.v, sizeof(v.v))) glUniform3fv(_uniform, 1, (GLfloat*)v.v);
 }
 //------------------------------------------------------------------------------
 
 void ShaderParam::operator<<(vec4_t& v)
 {
-	glUniform4fv(_uniform, 1, (GLfloat*)v.v);
+	if (changed(v.v, sizeof(v.v))) glUniform4fv(_uniform, 1, (GLfloat*)v.v);
 }
 //------------------------------------------------------------------------------
 
 void ShaderParam::operator<<(Vec3 v)
 {
-	glUniform3fv(_uniform, 1, (GLfloat*)v.v);
+	if (changed(v.v, sizeof(v.v))) glUniform3fv(_uniform, 1, (GLfloat*)v.v);
 }
 //------------------------------------------------------------------------------
 //
@@ -582,19 +951,19 @@ void ShaderParam::operator<<(Vec3 v)
 
 void ShaderParam::operator<<(mat3x3_t& m)
 {
-	glUniformMatrix3fv(_uniform, 1, GL_FALSE, (GLfloat*)m.v);
+	if (changed(m.v, sizeof(m.v))) glUniformMatrix3fv(_uniform, 1, GL_FALSE, (GLfloat*)m.v);
 }
 //------------------------------------------------------------------------------
 
 void ShaderParam::operator<<(mat4x4_t& m)
 {
-	glUniformMatrix4fv(_uniform, 1, GL_FALSE, (GLfloat*)m.v);
+	if (changed(m.v, sizeof(m.v))) glUniformMatrix4fv(_uniform, 1, GL_FALSE, (GLfloat*)m.v);
 }
 //------------------------------------------------------------------------------
 
 void ShaderParam::operator<<(GLint i)
 {
-	glUniform1i(_uniform, i);
+	if (changed(&i, sizeof(i))) glUniform1i(_uniform, i);
 }
 //------------------------------------------------------------------------------
 
@@ -602,7 +971,7 @@ void ShaderParam::operator<<(Tex t)
 {
 	glActiveTexture(GL_TEXTURE0 + _program->_tex_counter);
 	glBindTexture(GL_TEXTURE_2D, t);
-	glUniform1i(_uniform, _program->_tex_counter);
+	*this << (GLint)_program->_tex_counter;
 	_program->_tex_counter++;
 }
 //------------------------------------------------------------------------------
@@ -614,7 +983,7 @@ void ShaderParam::operator<<(Cubemap* c)
 	assert(gl_get_error());
 	glBindTexture(GL_TEXTURE_CUBE_MAP, c->_map);
 	assert(gl_get_error());
-	glUniform1i(_uniform, _program->_tex_counter);
+	*this << (GLint)_program->_tex_counter;
 	assert(gl_get_error());
 	_program->_tex_counter++;
 }
@@ -27,6 +27,60 @@ struct ShaderConfig {
 };
 
 
+/**
+ * @brief a uniform's name, interned once to a small integer. Programs keep
+ *        their ShaderParams in a table indexed by it, so setting a uniform
+ *        through a handle costs an array index rather than a string lookup.
+ *        Construct them once, typically as statics.
+ */
+struct Uniform {
+	explicit Uniform(const char* name);
+
+	const std::string& name() const;
+
+	unsigned int id;
+};
+
+
+/**
+ * @brief a std140 uniform block shared by every program built with
+ *        Shader::uniform_blocks. Its members are ordinary uniform names, so
+ *        shader code reads them the same either way.
+ */
+struct UniformBlock {
+	const char* name;
+	GLuint binding;
+	std::vector<std::pair<std::string, std::string>> members; // type, name
+
+	// camera, and the scene's light, as RendererGL writes them each frame
+	static const UniformBlock frame, light;
+
+	/**
+	 * @brief true if the requested context version has uniform buffers.
+	 *        Without them programs declare block members as plain
+	 *        uniforms, and updating the blocks does nothing.
+	 */
+	static bool supported();
+};
+
+
+// CPU side layouts of the blocks above, std140 padded
+struct FrameUniforms {
+	mat4x4 view_matrix;
+	mat4x4 proj_matrix;
+	vec3 view_position;
+	float _pad;
+};
+
+struct LightUniforms {
+	mat4x4 proj_matrix;
+	vec3 position;
+	float ambience;
+	vec3 power;
+	float _pad;
+};
+
+
 struct ShaderParam {
 	ShaderParam(ShaderProgram* program, const char* name);
 
@@ -40,9 +94,22 @@ struct ShaderParam {
 	void operator<<(GLint i);
 	void operator<<(Tex t);
 	void operator<<(Cubemap* c);
+
+	/**
+	 * @brief values set unchanged, whose glUniform call was skipped, and
+	 *        values that went to GL. Never reset here, clear them per frame
+	 *        to see what each one saves
+	 */
+	static unsigned int cache_hits, cache_misses;
 private:
+	bool changed(const void* value, size_t size);
+
 	ShaderProgram* _program;
 	GLint _uniform;
+
+	// last value sent to GL, uniforms keep theirs per program
+	uint8_t _shadow[sizeof(mat4x4)];
+	size_t _shadow_size = 0;
 };
 
 
@@ -63,6 +130,8 @@ struct Shader {
 		VERT_UV       = 2,
 		VERT_NORMAL   = 4,
 		VERT_TANGENT  = 8,
+		VERT_PACKED   = 16, // inputs are PackedVertex fields, decoded in place
+		VERT_OBJECT   = 32, // world and normal matrices come from the ObjectRing
 	};
 
 	struct Code {
@@ -162,6 +231,15 @@ struct Shader {
 	GLenum type;
 	std::string name;
 
+	/**
+	 * @brief declare camera and light uniforms in the shared blocks,
+	 *        written once a frame instead of once per program. Leave it
+	 *        off for programs drawn from other viewpoints mid frame, like
+	 *        shadow and cubemap passes. preceded_by() carries it over
+	 *        from the previous stage.
+	 */
+	bool uniform_blocks = false;
+
 	std::vector<Variable> inputs, outputs, parameters, locals;
 	std::vector<Code> statements;
 
@@ -184,6 +262,12 @@ struct Shader {
 	Shader& viewed();
 	Shader& projected();
 	Shader& transformed();
+
+	/**
+	 * @brief in place of transformed(), displace a Terrain patch by
+	 *        its height texture and morph it toward the next coarser level
+	 */
+	Shader& terrain_displaced();
 	Shader& compute_binormal();
 	Shader& emit_position();
 	Shader& pass_through(std::string name);
@@ -234,6 +318,7 @@ struct Shader {
 private:
 	std::string suffix();
 	int _code_block;
+	bool _object_indexed = false;
 };
 
 
@@ -244,8 +329,19 @@ struct ShaderProgram {
 	GLint primative;
 	std::string name;
 
+	/**
+	 * @brief built with Shader::VERT_OBJECT, draws must push their
+	 *        transforms to the ObjectRing rather than set uniforms
+	 */
+	bool object_indexed = false;
+
 	ShaderProgram& use();
 
+	ShaderParam& operator[](const Uniform& uniform);
+
+	/**
+	 * @brief a string lookup on every call, prefer a Uniform held onto
+	 */
 	ShaderParam& operator[](std::string name);
 
 	void operator<<(Material* m);
@@ -264,8 +360,10 @@ struct ShaderProgram {
 	static ShaderProgram& builtin_realistic();
 	static ShaderProgram& builtin_shadow_depth();
 	static ShaderProgram& builtin_normal_colors();
+	static ShaderProgram& builtin_terrain();
 private:
-	std::map<std::string, ShaderParam*> _params;
+	std::vector<ShaderParam*> _params; // indexed by Uniform::id
+	std::map<std::string, ShaderParam*> _named;
 	int _tex_counter;
 };
 
@@ -279,7 +377,21 @@ public:
 
 	ShaderProgram* operator[](ShaderConfig config);
 
+	/**
+	 * @brief write the shared uniform blocks and bind them to their
+	 *        binding points. Must be called from the GL context thread.
+	 */
+	void update_blocks(Viewer* viewer, Light* light);
+
+	/**
+	 * @brief overwrite just the frame block's camera, for passes that
+	 *        draw from somewhere other than a Viewer. Draws already issued
+	 *        keep the values they were issued with.
+	 */
+	void update_frame_block(mat4x4 view, mat4x4 proj, vec3 position);
+
 private:
+	GLuint _block_buffers[2] = {};
 	std::string _shader_path;
 	std::map<std::string, GLint> _shader_cache;
 	std::map<std::string, ShaderProgram> _program_cache;
@@ -287,4 +399,69 @@ private:
 
 extern ShaderCache Shaders;
 
+
+/**
+ * @brief per draw transforms, written straight into a persistently mapped
+ *        shader storage buffer. It's split into one slot per frame in
+ *        flight, each fenced, so the CPU never writes what the GPU may
+ *        still be reading. A draw's index reaches the vertex shader as its
+ *        base instance, through an instanced attribute counting up from 0.
+ *        Needs a GL 4.4 context, see supported().
+ */
+class ObjectRing {
+public:
+	static const GLuint binding = 2;   // shader storage binding point
+	static const GLuint attribute = 4; // location of the index attribute
+	static const int frames = 3;
+
+	/**
+	 * @param capacity draws a single frame is expected to push
+	 */
+	ObjectRing(unsigned int capacity=16384);
+
+	/**
+	 * @brief true if the requested context version has everything the
+	 *        ring needs, buffer storage and storage blocks
+	 */
+	static bool supported();
+
+	/**
+	 * @brief wait for the GPU to release the next slot and bind it.
+	 *        Called by RendererGL before any drawing.
+	 */
+	void begin_frame();
+
+	/**
+	 * @brief fence the slot the frame was drawn from
+	 */
+	void end_frame();
+
+	/**
+	 * @brief copy a transform into the current slot. A frame pushing more
+	 *        than capacity moves the ring to a buffer twice the size,
+	 *        which it keeps from then on.
+	 * @return index of the transform, to be drawn as the base instance
+	 */
+	GLuint push(mat4x4 world, mat3x3 normal_matrix);
+
+	/**
+	 * @brief point the index attribute at its counting buffer, for the
+	 *        currently bound vertex array
+	 */
+	void bind_attribute();
+
+	unsigned int capacity;
+
+private:
+	void allocate(unsigned int capacity);
+	void bind_slot();
+
+	GLuint _buffer = 0, _indices = 0;
+	GLsync _fences[frames] = {};
+	float* _mapped = nullptr;
+	unsigned int _slot = 0, _cursor = 0;
+};
+
+extern ObjectRing Objects;
+
 }
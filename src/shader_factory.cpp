@@ -31,26 +31,72 @@ std::string Shader::shortint() { return "short"; }
 
 Shader& Shader::vertex(int feature_flags)
 {
+	bool packed = feature_flags & Shader::VERT_PACKED;
+
+	// Packed inputs are declared with their stored types, but their
+	// expressions decode them, so every later stage reads plain vec3s
 	if (feature_flags & Shader::VERT_POSITION)
 	{
-		input("position_in").as(Shader::vec(3));
+		auto& position = input("position_in").as(Shader::vec(3));
+
+		if (packed)
+		{
+			// w carries the tangent's handedness
+			auto u_offset = parameter("u_position_offset").as(Shader::vec(3));
+			auto u_scale = parameter("u_position_scale").as(Shader::vec(3));
+			position.as(Shader::vec(4));
+			position.str = "(" + u_offset.str + " + " + position.name + ".xyz * " + u_scale.str + ")";
+		}
 	}
 
+	// octahedral decode, folding the lower hemisphere back out
+	auto oct_decode = [](Shader::Variable& v) {
+		std::string e = v.name;
+		v.as(Shader::vec(2));
+		v.str = "normalize(vec3(" + e + " - sign(" + e + ") * max(abs(" + e + ".x) + abs(" + e + ".y) - 1.0, 0.0), " +
+		        "1.0 - abs(" + e + ".x) - abs(" + e + ".y)))";
+	};
+
 	if (feature_flags & Shader::VERT_NORMAL)
 	{
-		input("normal_in").as(Shader::vec(3));
+		auto& normal = input("normal_in").as(Shader::vec(3));
+		if (packed) oct_decode(normal);
 	}
 
 	if (feature_flags & Shader::VERT_TANGENT)
 	{
-		input("tangent_in").as(Shader::vec(3));
+		auto& tangent = input("tangent_in").as(Shader::vec(4));
+		std::string handedness = "(tangent_in.w < 0.0 ? -1.0 : 1.0)";
+
+		if (packed)
+		{
+			oct_decode(tangent);
+			handedness = feature_flags & Shader::VERT_POSITION ? "(position_in.w < 0.5 ? -1.0 : 1.0)" : "1.0";
+		}
+		else
+		{
+			tangent.str = tangent.name + ".xyz";
+		}
+
+		// compute_binormal() flips the bitangent by it
+		auto l_handedness = local("l_handedness").as(Shader::vec(1));
+		next(l_handedness = Expression(handedness));
 	}
 
 	if (feature_flags & Shader::VERT_UV)
 	{
+		// half float pairs, GL fills in z
 		input("texcoord_in").as(Shader::vec(3));
 	}
 
+	// transforms are read from the ring, code() declares where from
+	if (feature_flags & Shader::VERT_OBJECT)
+	{
+		_object_indexed = true;
+		parameter("u_world_matrix").as(mat(4)).str = "seen_objects[object_in * 2u]";
+		parameter("u_normal_matrix").as(mat(3)).str = "mat3(seen_objects[object_in * 2u + 1u])";
+	}
+
 	return *this;
 }
 
@@ -195,6 +241,8 @@ Shader& Shader::preceded_by(Shader& previous)
 		inputs.push_back(input);
 	}
 
+	uniform_blocks = previous.uniform_blocks;
+
 	return *this;
 }
 //------------------------------------------------------------------------------
@@ -232,6 +280,78 @@ Shader& Shader::transformed()
 }
 //------------------------------------------------------------------------------
 
+Shader& Shader::terrain_displaced()
+{
+	Shader::Variable* pos = has_input("position_*");
+
+	assert(pos);
+
+	auto u_world = parameter("u_world_matrix").as(mat(4));
+	auto u_normal_matrix = parameter("u_normal_matrix").as(mat(3));
+	auto u_view_pos = parameter("u_view_position").as(vec(3));
+	auto u_terrain = parameter("u_terrain").as(vec(4));
+	auto u_node = parameter("u_terrain_node").as(vec(3));
+	auto u_morph = parameter("u_terrain_morph").as(vec(3));
+	auto u_heights = parameter("u_height_sampler").as(tex(2));
+
+	auto l_texel = local("l_texel").as(vec(2));
+	auto l_span = local("l_span").as(vec(2));
+	auto l_grid = local("l_grid").as(vec(2));
+	auto l_xz = local("l_xz").as(vec(2));
+	auto l_uv = local("l_uv").as(vec(2));
+	auto l_height = local("l_height").as(vec(1));
+	auto l_morph = local("l_morph").as(vec(1));
+	auto l_dh = local("l_dh").as(vec(2));
+	auto l_pos_trans = local("l_pos_trans").as(vec(4));
+
+	// world xz to texel centers, so the terrain's edges land on edge texels
+	auto uv_at = [&](Expression xz) -> Expression {
+		return { "(" + xz.str + " / " + u_terrain.str + ".x + 0.5) * (1.0 - " + l_texel.str + ") + 0.5 * " + l_texel.str };
+	};
+	auto height_at = [&](Expression uv) -> Expression {
+		return call("textureLod", { u_heights, uv, {"0.0"} })["r"] * u_terrain["y"];
+	};
+
+	next(l_texel = vec(2, "1.0 / %s.z, 1.0 / %s.w", u_terrain.cstr(), u_terrain.cstr()));
+	next(l_span = vec(2, "2.0 * %s.x / (%s.z - 1.0), 2.0 * %s.x / (%s.w - 1.0)",
+	                  u_terrain.cstr(), u_terrain.cstr(), u_terrain.cstr(), u_terrain.cstr()));
+
+	// position_in is a unit grid, u_terrain_morph.z quads a side
+	next(l_grid = (*pos)["xz"] * u_morph["z"]);
+	next(l_xz = u_node["xy"] + (*pos)["xz"] * u_node["z"]);
+	next(l_height = height_at(uv_at(l_xz)));
+
+	// past the start of the morph range odd grid lines slide onto their
+	// even neighbours, reaching the next coarser grid at its end
+	next(l_morph = call("distance", { u_view_pos, call("vec3", { l_xz["x"], l_height, l_xz["y"] }) }));
+	next(l_morph = Expression("(" + l_morph.str + " - " + u_morph.str + ".x) / (" +
+	                          u_morph.str + ".y - " + u_morph.str + ".x)").saturate());
+	next(l_grid -= call("fract", { l_grid * 0.5 }) * 2.0 * l_morph);
+
+	next(l_xz = u_node["xy"] + l_grid / u_morph["z"] * u_node["z"]);
+	next(l_uv = uv_at(l_xz));
+	next(l_height = height_at(l_uv));
+	next(l_pos_trans = u_world * call("vec4", { l_xz["x"], l_height, l_xz["y"], {"1.0"} }));
+
+	// central differences a texel either side
+	auto dx = height_at({ l_uv.str + " + vec2(" + l_texel.str + ".x, 0.0)" }) -
+	          height_at({ l_uv.str + " - vec2(" + l_texel.str + ".x, 0.0)" });
+	auto dz = height_at({ l_uv.str + " + vec2(0.0, " + l_texel.str + ".y)" }) -
+	          height_at({ l_uv.str + " - vec2(0.0, " + l_texel.str + ".y)" });
+	next(l_dh = call("vec2", { dx, dz }) / l_span);
+
+	auto o_normal = output("normal_" + suffix()).as(vec(3));
+	auto o_tangent = output("tangent_" + suffix()).as(vec(3));
+	auto o_texcoord = output("texcoord_" + suffix()).as(vec(3));
+
+	next(o_normal = u_normal_matrix * vec(3, "-%s.x, 1.0, -%s.y", l_dh.cstr(), l_dh.cstr()).normalize());
+	next(o_tangent = u_normal_matrix * vec(3, "1.0, %s.x, 0.0", l_dh.cstr()).normalize());
+	next(o_texcoord = call("vec3", { l_xz, {"0.0"} }));
+
+	return *this;
+}
+//------------------------------------------------------------------------------
+
 Shader& Shader::compute_binormal()
 {
 	auto o_binormal = output("biormal_" + suffix()).as(vec(3));
@@ -241,7 +361,17 @@ Shader& Shader::compute_binormal()
 
 	assert(norm && tang);
 
-	next(o_binormal = norm->cross(*tang));
+	// mirrored uv islands need their bitangent flipped
+	Shader::Variable* handedness = has_variable("l_handedness", locals);
+
+	if (handedness)
+	{
+		next(o_binormal = norm->cross(*tang) * *handedness);
+	}
+	else
+	{
+		next(o_binormal = norm->cross(*tang));
+	}
 
 	return *this;
 }
@@ -642,6 +772,10 @@ std::string Shader::code()
 			{
 				src << "layout(location = " << std::to_string(i) << ") " << inputs[i].declaration() << ";" << std::endl;
 			}
+			if (_object_indexed)
+			{
+				src << "layout(location = " << ObjectRing::attribute << ") in uint object_in;" << std::endl;
+			}
 			src << std::endl;
 			emit_var_list(outputs);
 			break;
@@ -676,8 +810,42 @@ std::string Shader::code()
 
 	src << std::endl;
 
+	// a block is declared whole wherever any of its members is used, so
+	// its layout is the same in every program
+	std::vector<std::string> in_blocks;
+	for (auto block : { &UniformBlock::frame, &UniformBlock::light })
+	{
+		if (!uniform_blocks || !UniformBlock::supported()) break;
+
+		bool used = false;
+		for (auto& member : block->members)
+		{
+			used |= has_variable(member.second, parameters) != nullptr;
+		}
+
+		if (!used) continue;
+
+		src << "layout(std140) uniform " << block->name << " {" << std::endl;
+		for (auto& member : block->members)
+		{
+			src << "\t" << member.first << " " << member.second << ";" << std::endl;
+			in_blocks.push_back(member.second);
+		}
+		src << "};" << std::endl;
+	}
+
+	if (_object_indexed)
+	{
+		src << "layout(std430, binding = " << ObjectRing::binding << ") readonly buffer seen_object_ring {" << std::endl;
+		src << "\tmat4 seen_objects[];" << std::endl;
+		src << "};" << std::endl;
+		in_blocks.push_back("u_world_matrix");
+		in_blocks.push_back("u_normal_matrix");
+	}
+
 	for (auto param : parameters)
 	{
+		if (std::count(in_blocks.begin(), in_blocks.end(), param.name)) continue;
 		src << param.declaration() << ";" << std::endl;
 	}
 
@@ -0,0 +1,86 @@
+#include "seen.hpp"
+
+using namespace seen;
+
+static int failures;
+
+#define EXPECT(cond) if (!(cond)) { fprintf(stderr, "%s:%d: expected %s\n", __FILE__, __LINE__, #cond); failures++; }
+
+//------------------------------------------------------------------------------
+// what GL and a VERT_PACKED vertex shader do with a PackedVertex
+static void decode_position(vec3 out, const PackedVertex& p, const vec3 offset, const vec3 scale)
+{
+	for (int j = 3; j--;)
+	{
+		// GL_UNSIGNED_SHORT, normalized
+		float unorm = p.position[j] / 65535.f;
+		out[j] = offset[j] + unorm * scale[j];
+	}
+}
+//------------------------------------------------------------------------------
+
+static void decode_direction(vec3 out, const int16_t e[2])
+{
+	// GL_SHORT, normalized
+	float x = std::max(e[0] / 32767.f, -1.f);
+	float y = std::max(e[1] / 32767.f, -1.f);
+	float fold = std::max(fabsf(x) + fabsf(y) - 1.f, 0.f);
+
+	out[0] = x - (x > 0 ? 1 : x < 0 ? -1 : 0) * fold;
+	out[1] = y - (y > 0 ? 1 : y < 0 ? -1 : 0) * fold;
+	out[2] = 1.f - fabsf(x) - fabsf(y);
+	vec3_norm(out, out);
+}
+//------------------------------------------------------------------------------
+
+int main(int argc, char* argv[])
+{
+	Bounds bounds;
+	bounds.min = Vec3(-12.5f, 0, 3);
+	bounds.max = Vec3(40, 2, 3); // flat in z
+
+	vec3 offset, scale;
+	PackedVertex::quantization(bounds, offset, scale);
+
+	srand(1);
+	for (int i = 0; i < 1000; i++)
+	{
+		Vertex v = {};
+		for (int j = 3; j--;)
+		{
+			float t = rand() / (float)RAND_MAX;
+			v.position[j] = bounds.min.v[j] + t * (bounds.max.v[j] - bounds.min.v[j]);
+			v.normal[j] = t * 2 - 1;
+		}
+		vec3_norm(v.normal, v.normal);
+		v.tangent[3] = i & 1 ? -1 : 1;
+
+		PackedVertex p = PackedVertex::pack(v, offset, scale);
+
+		vec3 position, normal;
+		decode_position(position, p, offset, scale);
+		decode_direction(normal, p.normal);
+
+		// within half a quantization step, plus float slack
+		for (int j = 3; j--;)
+		{
+			float step = (bounds.max.v[j] - bounds.min.v[j]) / 65535.f;
+			EXPECT(fabsf(position[j] - v.position[j]) <= step * 0.5f + 1e-5f);
+		}
+
+		EXPECT(vec3_mul_inner(normal, v.normal) > 0.9999f);
+
+		// handedness rides in position's w
+		float handedness = p.position[3] / 65535.f < 0.5f ? -1 : 1;
+		EXPECT(handedness == v.tangent[3]);
+	}
+
+	// the box's corners come back exactly
+	Vertex corner = {};
+	vec3_copy(corner.position, bounds.max.v);
+	vec3 position;
+	decode_position(position, PackedVertex::pack(corner, offset, scale), offset, scale);
+	EXPECT(position[0] == 40 && position[1] == 2 && position[2] == 3);
+
+	return failures ? 1 : 0;
+}
@@ -0,0 +1,92 @@
+#include "seen.hpp"
+
+using namespace seen;
+
+static int failures;
+
+#define EXPECT(cond) if (!(cond)) { fprintf(stderr, "%s:%d: expected %s\n", __FILE__, __LINE__, #cond); failures++; }
+
+//------------------------------------------------------------------------------
+static STLMesh* load(const char* text)
+{
+	char path[] = "/tmp/seen_stl_XXXXXX";
+	int fd = mkstemp(path);
+	assert(fd >= 0);
+
+	assert(write(fd, text, strlen(text)) == (ssize_t)strlen(text));
+	lseek(fd, 0, SEEK_SET);
+
+	STLMesh* mesh = new STLMesh(fd);
+
+	close(fd);
+	unlink(path);
+
+	return mesh;
+}
+//------------------------------------------------------------------------------
+
+// two triangles sharing an edge, so four welded vertices
+static void check_quad(STLMesh* mesh)
+{
+	EXPECT(mesh->tri_count == 2);
+	EXPECT(mesh->vert_count() == 4);
+	EXPECT(mesh->index_count() == 6);
+
+	Vec3 min = mesh->bounds().min, max = mesh->bounds().max;
+	EXPECT(min.x == 0 && min.y == 0 && min.z == 0);
+	EXPECT(max.x == 1 && max.y == 1 && max.z == 0);
+
+	// every facet faces +z
+	for (unsigned int i = 0; i < mesh->vert_count(); i++)
+	{
+		EXPECT(fabs(mesh->verts()[i].normal[2] - 1) < 1e-6);
+	}
+
+	delete mesh;
+}
+//------------------------------------------------------------------------------
+
+int main(int argc, char* argv[])
+{
+	// unindented, LF terminated
+	check_quad(load(
+		"solid quad\n"
+		"facet normal 0 0 1\n"
+		"outer loop\n"
+		"vertex 0 0 0\n"
+		"vertex 1 0 0\n"
+		"vertex 1 1 0\n"
+		"endloop\n"
+		"endfacet\n"
+		"facet normal 0 0 1\n"
+		"outer loop\n"
+		"vertex 0 0 0\n"
+		"vertex 1 1 0\n"
+		"vertex 0 1 0\n"
+		"endloop\n"
+		"endfacet\n"
+		"endsolid quad\n"
+	));
+
+	// CRLF terminated, with mantissas too long for the fast float path
+	check_quad(load(
+		"solid quad\r\n"
+		"facet normal 0 0 1\r\n"
+		"outer loop\r\n"
+		"vertex 0.0000000000000000000 0 0\r\n"
+		"vertex 1.0000000000000000000 0 0\r\n"
+		"vertex 1.0000000000000000000 1.0000000000000000000 0\r\n"
+		"endloop\r\n"
+		"endfacet\r\n"
+		"facet normal 0 0 1\r\n"
+		"outer loop\r\n"
+		"vertex 0 0 0\r\n"
+		"vertex 1 1 0\r\n"
+		"vertex 0 1.0000000000000000000 0\r\n"
+		"endloop\r\n"
+		"endfacet\r\n"
+		"endsolid quad"
+	));
+
+	return failures ? 1 : 0;
+}
@@ -1,4 +1,5 @@
 #include "texture.hpp"
+#include "loader.hpp"
 #include <png.h>
 #ifdef __APPLE__
 #include <OpenGL/gl3.h>
@@ -97,7 +98,8 @@ int TextureFactory::load_texture_buffer(
 	void** data,
 	int& width,
 	int& height,
-	int& depth)
+	int& depth,
+	int* bit_depth)
 {
 	char header[8];    // 8 is the maximum size that can be checked
 	png_structp png_ptr = {};
@@ -143,11 +145,33 @@ int TextureFactory::load_texture_buffer(
 
 	width = png_get_image_width(png_ptr, info_ptr);
 	height = png_get_image_height(png_ptr, info_ptr);
-	color_type = png_get_color_type(png_ptr, info_ptr);
-	//bit_depth = png_get_bit_depth(png_ptr, info_ptr);
+
+	// palettes and packed gray are expanded to whole bytes. 16 bit
+	// channels are only kept for callers that asked for the bit depth,
+	// in host byte order
+	png_set_palette_to_rgb(png_ptr);
+	png_set_expand_gray_1_2_4_to_8(png_ptr);
+	if (png_get_bit_depth(png_ptr, info_ptr) == 16)
+	{
+		if (bit_depth)
+		{
+			uint16_t one = 1;
+			if (*(uint8_t*)&one) png_set_swap(png_ptr);
+		}
+		else
+		{
+			png_set_strip_16(png_ptr);
+		}
+	}
 
 	//number_of_passes = png_set_interlace_handling(png_ptr);
 	png_read_update_info(png_ptr, info_ptr);
+	color_type = png_get_color_type(png_ptr, info_ptr);
+
+	if (bit_depth)
+	{
+		*bit_depth = png_get_bit_depth(png_ptr, info_ptr);
+	}
 
 	/* read file */
 	if (setjmp(png_jmpbuf(png_ptr)))
@@ -163,10 +187,16 @@ int TextureFactory::load_texture_buffer(
 		case PNG_COLOR_TYPE_RGB:
 			depth = 3;
 			break;
+		case PNG_COLOR_TYPE_GRAY_ALPHA:
+			depth = 2;
+			break;
+		case PNG_COLOR_TYPE_GRAY:
+			depth = 1;
+			break;
 	}
 
 	row_pointers = (png_bytep*) malloc(sizeof(png_bytep) * height);
-	char* pixel_buf = (char*)calloc(depth * width * height, sizeof(char));
+	char* pixel_buf = (char*)calloc(png_get_rowbytes(png_ptr, info_ptr) * height, sizeof(char));
 
 	for (int y = 0; y < height; y++)
 	{
@@ -193,16 +223,8 @@ int TextureFactory::load_texture_buffer(
 }
 //------------------------------------------------------------------------------
 
-Tex TextureFactory::load_texture(std::string path)
+static Tex create_texture_from_buffer(int width, int height, int depth, void* pixel_buf)
 {
-	int width, height, depth;
-	void* pixel_buf = nullptr;
-
-	if (load_texture_buffer(path, &pixel_buf, width, height, depth))
-	{
-		return -1;
-	}
-
 	GLenum gl_color_type;
 	switch (depth)
 	{
@@ -212,9 +234,15 @@ Tex TextureFactory::load_texture(std::string path)
 		case 3:
 			gl_color_type = GL_RGB;
 			break;
+		case 2:
+			gl_color_type = GL_RG;
+			break;
+		default:
+			gl_color_type = GL_RED;
+			break;
 	}
 
-	Tex tex = create_texture(width, height, gl_color_type, pixel_buf);
+	Tex tex = TextureFactory::create_texture(width, height, gl_color_type, pixel_buf);
 
 	assert(gl_get_error());
 
@@ -222,6 +250,23 @@ Tex TextureFactory::load_texture(std::string path)
 }
 //------------------------------------------------------------------------------
 
+Tex TextureFactory::load_texture(std::string path)
+{
+	int width, height, depth;
+	void* pixel_buf = nullptr;
+
+	if (load_texture_buffer(path, &pixel_buf, width, height, depth))
+	{
+		return -1;
+	}
+
+	Tex tex = create_texture_from_buffer(width, height, depth, pixel_buf);
+	free(pixel_buf);
+
+	return tex;
+}
+//------------------------------------------------------------------------------
+
 Material* TextureFactory::get_material(const std::string path)
 {
 	static std::map<std::string, Material*> _cached_materials;
@@ -238,3 +283,53 @@ Material* TextureFactory::get_material(const std::string path)
 
 	return _cached_materials[path];
 }
+//------------------------------------------------------------------------------
+
+std::shared_future<Material*> TextureFactory::get_material_async(const std::string path)
+{
+	static std::map<std::string, std::shared_future<Material*>> _cached_materials;
+
+	if(_cached_materials.count(path) == 0)
+	{
+		auto promise = std::make_shared<std::promise<Material*>>();
+		_cached_materials[path] = promise->get_future().share();
+
+		Loader.enqueue([=]() {
+			const std::string suffixes[] = { ".color.png", ".normal.png", ".specular.png" };
+			Material* material = new Material();
+
+			// uploads all run on the context thread, so no locking is
+			// needed to count down the textures still outstanding
+			auto remaining = std::make_shared<int>(3);
+
+			for (int i = 0; i < 3; i++)
+			{
+				int width, height, depth;
+				void* pixel_buf = nullptr;
+
+				if (load_texture_buffer(path + suffixes[i], &pixel_buf, width, height, depth))
+				{
+					pixel_buf = nullptr;
+					width = height = depth = 0;
+				}
+
+				Loader.upload(width * height * depth, [=]() {
+					material->v[i] = -1;
+
+					if (pixel_buf)
+					{
+						material->v[i] = create_texture_from_buffer(width, height, depth, pixel_buf);
+						free(pixel_buf);
+					}
+
+					if (--(*remaining) == 0)
+					{
+						promise->set_value(material);
+					}
+				});
+			}
+		});
+	}
+
+	return _cached_materials[path];
+}
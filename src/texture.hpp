@@ -33,13 +33,29 @@ public:
 	static Tex create_texture(int width, int height, GLenum format, void* data);
 	static Tex create_texture(int width, int height, GLenum format, GLenum storage, void* data);
 	static Tex load_texture(std::string path);
+	/**
+	 * @brief decode a PNG into a malloc'd buffer of depth channels per pixel
+	 * @param bit_depth when given, 16 bit images are kept at 16 bits per
+	 *        channel and this is set to 8 or 16. Otherwise they're reduced
+	 *        to 8
+	 * @return 0 on success
+	 */
 	static int load_texture_buffer(
 		std::string path,
 		void** data,
 		int& width,
 		int& height,
-		int& depth);
+		int& depth,
+		int* bit_depth=nullptr);
 	static Material* get_material(const std::string path);
+
+	/**
+	 * @brief decode the material's images on a worker thread, and upload
+	 *        them through the Loader's queue. Must be called from the GL
+	 *        context thread.
+	 * @return future that becomes ready once all textures are uploaded
+	 */
+	static std::shared_future<Material*> get_material_async(const std::string path);
 };
 
 }